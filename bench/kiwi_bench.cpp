@@ -0,0 +1,328 @@
+// kiwi-bench: throughput harness for KiwiInterpreter::run
+//
+// Build:  g++ -std=c++17 -O2 bench/kiwi_bench.cpp -o kiwi-bench
+// Usage:  kiwi-bench [filter] [--runs N] [--threads N]
+
+#include "../kiwi/interpreter.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#if KIWI_POSIX
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Global allocation counter; counts every operator new in the process
+static std::atomic<unsigned long long> allocation_count{0};
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+// GCC cannot see that the replaced operator new pairs with free()
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+struct Workload {
+    const char* name;
+    std::vector<std::string> script;
+    long ops; // Loop iterations (or calls) per run
+};
+
+static std::vector<std::string> split_lines(const std::string& text) {
+    std::vector<std::string> lines;
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) lines.push_back(line);
+    return lines;
+}
+
+// Tight numeric loop driven by math
+static Workload numeric_loop() {
+    return {"numeric-loop", split_lines(
+        "set i 0\n"
+        "set acc 0\n"
+        "loop\n"
+        "    math i = i + 1\n"
+        "    math acc = acc + i * 2 - (i / 4)\n"
+        "    if i >= 100000\n"
+        "        break\n"
+        "    endif\n"
+        "endloop\n"), 100000};
+}
+
+// The same loop counted by for
+static Workload counted_loop() {
+    return {"counted-loop", split_lines(
+        "set acc 0\n"
+        "for i = 1 to 100000\n"
+        "    math acc = acc + i * 2 - (i / 4)\n"
+        "endfor\n"), 100000};
+}
+
+// print with many placeholders per line
+static Workload interpolation() {
+    return {"interpolation", split_lines(
+        "set i 0\n"
+        "set name kiwi\n"
+        "set unit ms\n"
+        "set host example.org\n"
+        "loop\n"
+        "    math i = i + 1\n"
+        "    print [{{i}}] {{name}}@{{host}} took {{i}}{{unit}} ({{name}}/{{unit}}/{{host}}) total=<i * 3>\n"
+        "    if i >= 20000\n"
+        "        break\n"
+        "    endif\n"
+        "endloop\n"), 20000};
+}
+
+// Deep chains of small helper calls
+static Workload call_chain() {
+    std::string text;
+    const int depth = 16;
+    for (int d = 0; d < depth; ++d) {
+        text += "func step" + std::to_string(d) + " x\n";
+        if (d + 1 < depth) {
+            text += "    local r\n";
+            text += "    call step" + std::to_string(d + 1) + " <x + 1> -> r\n";
+            text += "    return {{r}}\n";
+        } else {
+            text += "    return {{x}}\n";
+        }
+        text += "endfunc\n";
+    }
+    text +=
+        "set i 0\n"
+        "loop\n"
+        "    math i = i + 1\n"
+        "    call step0 {{i}} -> out\n"
+        "    if i >= 5000\n"
+        "        break\n"
+        "    endif\n"
+        "endloop\n";
+    return {"call-chain", split_lines(text), 5000L * depth};
+}
+
+// Variables named at runtime, the usual stand-in for arrays
+static Workload dynamic_names() {
+    return {"dynamic-names", split_lines(
+        "set i 0\n"
+        "set j 0\n"
+        "set prefix customer_record\n"
+        "loop\n"
+        "    math i = i + 1\n"
+        "    math j = j + 1\n"
+        "    if j > 64\n"
+        "        set j 1\n"
+        "    endif\n"
+        "    set {{prefix}}_{{j}}_label order number {{i}} awaiting shipment\n"
+        "    set {{prefix}}_{{j}}_total <i * 3>\n"
+        "    math sum = {{prefix}}_{{j}}_total + 1\n"
+        "    print {{{{prefix}}_{{j}}_label}}\n"
+        "    if i >= 20000\n"
+        "        break\n"
+        "    endif\n"
+        "endloop\n"), 20000};
+}
+
+// The same collection held in a native array
+static Workload array_ops() {
+    return {"array-ops", split_lines(
+        "array totals\n"
+        "for i = 1 to 20000\n"
+        "    push totals <i * 3>\n"
+        "    math last = totals[i - 1] + 1\n"
+        "endfor\n"
+        "sum total totals\n"
+        "sort totals\n"), 20000};
+}
+
+// Keyed lookups in a native dict
+static Workload dict_lookups() {
+    return {"dict-lookups", split_lines(
+        "dict index\n"
+        "for i = 1 to 256\n"
+        "    put index route_{{i}} <i * 7>\n"
+        "endfor\n"
+        "set hits 0\n"
+        "for round = 1 to 80\n"
+        "    for i = 1 to 256\n"
+        "        get v index route_{{i}}\n"
+        "        math hits = hits + v\n"
+        "    endfor\n"
+        "endfor\n"), 80L * 256};
+}
+
+// Long strings passed between variables, arguments and results
+static Workload string_copies() {
+    return {"string-copies", split_lines(
+        "func keep s\n"
+        "    return {{s}}\n"
+        "endfunc\n"
+        "set text The quick brown fox jumps over the lazy dog while the band plays on\n"
+        "array log {{text}}\n"
+        "for i = 1 to 20000\n"
+        "    set copy {{text}}\n"
+        "    call keep {{copy}} -> back\n"
+        "    set log[0] {{back}}\n"
+        "endfor\n"), 20000};
+}
+
+// Record munging with the string commands
+static Workload text_munging() {
+    return {"text-munging", split_lines(
+        "set row   id=42; name=kiwi; tags=fast,small,native   \n"
+        "for i = 1 to 20000\n"
+        "    trim clean {{row}}\n"
+        "    split fields {{clean}} \"; \"\n"
+        "    find at {{clean}} name=\n"
+        "    substr name {{clean}} at+5 4\n"
+        "    replace tags {{fields[2]}} , |\n"
+        "    upper shout {{name}}\n"
+        "endfor\n"), 20000};
+}
+
+// Dice rolls one at a time, then in bulk into an array
+static Workload random_draws() {
+    return {"random-draws", split_lines(
+        "seed 1\n"
+        "set total 0\n"
+        "for i = 1 to 50000\n"
+        "    random roll 1 6\n"
+        "    math total = total + roll\n"
+        "endfor\n"
+        "random rolls 1 6 50000\n"
+        "sum bulk rolls\n"), 100000};
+}
+
+// Long if ladders, the usual dispatch-on-value idiom
+static Workload if_ladder() {
+    std::string text =
+        "set i 0\n"
+        "set hits 0\n"
+        "loop\n"
+        "    math i = i + 1\n";
+    for (int k = 0; k < 64; ++k) {
+        text += "    if {{i}} == " + std::to_string(k * 97) + "\n";
+        text += "        math hits = hits + 1\n";
+        text += "    endif\n";
+    }
+    text +=
+        "    if i >= 10000\n"
+        "        break\n"
+        "    endif\n"
+        "endloop\n";
+    return {"if-ladder", split_lines(text), 10000};
+}
+
+// High-water RSS of the whole process, or -1 where it cannot be read
+static long peak_rss_kb() {
+#if KIWI_POSIX
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return -1;
+#endif
+}
+
+static void run_workload(const Workload& w, int runs, const std::shared_ptr<KiwiOutput>& null_output) {
+    KiwiInterpreter interpreter;
+    interpreter.set_output(null_output);
+    auto load_start = std::chrono::steady_clock::now();
+    interpreter.load_script(w.script);
+    auto load_time = std::chrono::steady_clock::now() - load_start;
+
+    interpreter.run(); // Warm-up
+    double best_ns = 1e300;
+    unsigned long long allocations = 0;
+    for (int r = 0; r < runs; ++r) {
+        interpreter.reset();
+        unsigned long long before = allocation_count.load();
+        auto start = std::chrono::steady_clock::now();
+        interpreter.run();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        allocations = allocation_count.load() - before;
+        best_ns = std::min(best_ns, static_cast<double>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+
+    std::printf("%-16s %12.3f %12.1f %14.3f %12.1f %10ld\n", w.name, best_ns / 1e6,
+                best_ns / w.ops, static_cast<double>(allocations) / w.ops,
+                std::chrono::duration<double, std::micro>(load_time).count(), peak_rss_kb());
+}
+
+int main(int argc, char** argv) {
+    std::string filter;
+    int runs = 5;
+    size_t threads = std::thread::hardware_concurrency();
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--runs" && i + 1 < argc) runs = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--threads" && i + 1 < argc) threads = std::max(1, std::atoi(argv[++i]));
+        else filter = arg;
+    }
+
+    std::vector<Workload> workloads = {numeric_loop(), counted_loop(), interpolation(),
+                                       call_chain(), dynamic_names(), array_ops(),
+                                       dict_lookups(), string_copies(), text_munging(),
+                                       random_draws(), if_ladder()};
+
+    auto null_output = std::make_shared<KiwiCallbackOutput>([](std::string_view) {});
+    std::printf("%-16s %12s %12s %14s %12s %10s\n",
+                "workload", "ms/run", "ns/op", "allocs/op", "load us", "peak KiB");
+    for (const Workload& w : workloads) {
+        if (!filter.empty() && std::string(w.name).find(filter) == std::string::npos) continue;
+
+#if KIWI_POSIX
+        // A child per workload, so the peak RSS column is that workload's
+        // own rather than the high-water mark of everything run before it
+        std::fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            run_workload(w, runs, null_output);
+            std::fflush(stdout);
+            _exit(0);
+        }
+        if (child > 0) {
+            int status = 0;
+            waitpid(child, &status, 0);
+            continue;
+        }
+#endif
+        run_workload(w, runs, null_output);
+    }
+
+    // The same workloads as many concurrent jobs sharing compiled programs
+    if (filter.empty() || std::string("batch").find(filter) != std::string::npos) {
+        KiwiBatchRunner runner(threads);
+        std::vector<KiwiJob> jobs;
+        for (const Workload& w : workloads) {
+            auto program = std::make_shared<const KiwiProgram>(w.script);
+            for (int j = 0; j < 16; ++j) jobs.push_back({program, {}, std::nullopt});
+        }
+        runner.run(jobs); // Warm-up
+        KiwiBatchReport report = runner.run(jobs);
+        auto us = [](std::chrono::nanoseconds ns) { return ns.count() / 1e3; };
+        std::printf("\nbatch: %zu jobs on %zu threads in %.3f ms, %.1f jobs/s, "
+                    "latency p50 %.1f us, p99 %.1f us\n",
+                    jobs.size(), runner.thread_count(), report.elapsed.count() / 1e6,
+                    report.throughput(), us(report.latency_percentile(50)),
+                    us(report.latency_percentile(99)));
+    }
+    return 0;
+}
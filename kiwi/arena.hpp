@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+// Bump allocator for short-lived data. Allocating is a pointer increment
+// and nothing is freed on its own: rewind() drops everything allocated
+// since a mark, reset() drops everything. Chunks are kept for reuse, so a
+// warmed-up arena does not touch the heap.
+class KiwiArena {
+public:
+    // Position to rewind to
+    struct Mark {
+        size_t chunk;
+        size_t used;
+    };
+
+    explicit KiwiArena(size_t chunk_size = 4096) : chunk_size(chunk_size) {}
+
+    KiwiArena(const KiwiArena&) = delete;
+    KiwiArena& operator=(const KiwiArena&) = delete;
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+        for (; current < chunks.size(); ++current, used = 0) {
+            size_t offset = (used + align - 1) & ~(align - 1);
+            if (offset + size <= chunks[current].size) {
+                used = offset + size;
+                return chunks[current].data.get() + offset;
+            }
+        }
+        // Every chunk is full; add one big enough, growing geometrically
+        size_t bytes = std::max(size + align, chunks.empty() ? chunk_size : chunks.back().size * 2);
+        chunks.push_back({std::make_unique<char[]>(bytes), bytes});
+        current = chunks.size() - 1;
+        used = size;
+        return chunks.back().data.get();
+    }
+
+    Mark mark() const { return {current, used}; }
+
+    // Drop everything allocated since m
+    void rewind(Mark m) {
+        current = m.chunk;
+        used = m.used;
+    }
+
+    // Drop everything
+    void reset() {
+        current = 0;
+        used = 0;
+    }
+
+    // Bytes held in chunks
+    size_t capacity() const {
+        size_t total = 0;
+        for (const Chunk& chunk : chunks) total += chunk.size;
+        return total;
+    }
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::vector<Chunk> chunks;
+    size_t current = 0; // Chunk being filled
+    size_t used = 0;    // Bytes used in it
+    size_t chunk_size;
+};
+
+// Standard allocator drawing from a KiwiArena; deallocation is a no-op
+template <typename T>
+class KiwiArenaAllocator {
+public:
+    using value_type = T;
+
+    explicit KiwiArenaAllocator(KiwiArena* arena) noexcept : arena(arena) {}
+
+    template <typename U>
+    KiwiArenaAllocator(const KiwiArenaAllocator<U>& other) noexcept : arena(other.arena) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) noexcept {}
+
+    template <typename U>
+    bool operator==(const KiwiArenaAllocator<U>& other) const noexcept { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const KiwiArenaAllocator<U>& other) const noexcept { return arena != other.arena; }
+
+private:
+    template <typename U>
+    friend class KiwiArenaAllocator;
+
+    KiwiArena* arena;
+};
+
+// String whose buffer lives in an arena
+using KiwiArenaString = std::basic_string<char, std::char_traits<char>, KiwiArenaAllocator<char>>;
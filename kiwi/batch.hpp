@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "context.hpp"
+#include "input.hpp"
+#include "output.hpp"
+#include "program.hpp"
+#include "random.hpp"
+
+// One script run: a compiled program and the lines its input commands read
+struct KiwiJob {
+    std::shared_ptr<const KiwiProgram> program;
+    std::vector<std::string> input;
+    std::optional<std::uint64_t> seed; // Random seed; a fresh one when unset
+};
+
+// Outcome of one job
+struct KiwiJobResult {
+    std::string output;                  // Everything the job printed
+    std::string errors;                  // Runtime diagnostics
+    std::chrono::nanoseconds latency{0}; // Time from start to finish of the run
+    bool ok = true;                      // False when the run threw
+};
+
+// Results of a batch, in job order, with aggregate figures
+struct KiwiBatchReport {
+    std::vector<KiwiJobResult> results;
+    std::chrono::nanoseconds elapsed{0}; // Wall time of the whole batch
+
+    // Completed jobs per second of wall time
+    double throughput() const {
+        return elapsed.count() ? results.size() * 1e9 / elapsed.count() : 0.0;
+    }
+
+    // Job latency at percentile p (0-100)
+    std::chrono::nanoseconds latency_percentile(double p) const {
+        if (results.empty()) return std::chrono::nanoseconds(0);
+        std::vector<std::chrono::nanoseconds> latencies;
+        latencies.reserve(results.size());
+        for (const KiwiJobResult& r : results) latencies.push_back(r.latency);
+        size_t rank = static_cast<size_t>(std::clamp(p, 0.0, 100.0) / 100.0 * (latencies.size() - 1) + 0.5);
+        std::nth_element(latencies.begin(), latencies.begin() + rank, latencies.end());
+        return latencies[rank];
+    }
+};
+
+// Runs batches of jobs on a pool of worker threads. Each worker keeps one
+// context and gives every job its own output, diagnostics, input and
+// random seed. Jobs are dealt to per-worker queues; a worker that runs dry
+// steals from the far end of the others'.
+class KiwiBatchRunner {
+public:
+    explicit KiwiBatchRunner(size_t threads = std::thread::hardware_concurrency())
+        : threads(std::max<size_t>(threads, 1)) {}
+
+    // Run every job and wait for all of them; the calling thread works too
+    KiwiBatchReport run(const std::vector<KiwiJob>& jobs) const {
+        for (const KiwiJob& job : jobs) {
+            if (!job.program) throw std::invalid_argument("KiwiJob without a program");
+        }
+        KiwiBatchReport report;
+        report.results.resize(jobs.size());
+        size_t workers = std::min(threads, std::max<size_t>(jobs.size(), 1));
+
+        // Contiguous blocks keep each worker on neighbouring jobs until it steals
+        std::vector<Queue> queues(workers);
+        for (size_t w = 0; w < workers; ++w) {
+            for (size_t i = w * jobs.size() / workers; i < (w + 1) * jobs.size() / workers; ++i) {
+                queues[w].jobs.push_back(i);
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> pool;
+        pool.reserve(workers - 1);
+        for (size_t w = 1; w < workers; ++w) {
+            pool.emplace_back([&, w] { work(w, queues, jobs, report.results); });
+        }
+        work(0, queues, jobs, report.results);
+        for (std::thread& t : pool) t.join();
+        report.elapsed = std::chrono::steady_clock::now() - start;
+        return report;
+    }
+
+    size_t thread_count() const { return threads; }
+
+private:
+    // Job indices owned by one worker; the owner pops the back, thieves the front
+    struct Queue {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+
+    size_t threads;
+
+    // Next job for worker w, stolen from another queue when its own is empty
+    static bool take(size_t w, std::vector<Queue>& queues, size_t& job) {
+        {
+            std::lock_guard<std::mutex> guard(queues[w].lock);
+            if (!queues[w].jobs.empty()) {
+                job = queues[w].jobs.back();
+                queues[w].jobs.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); ++k) {
+            Queue& victim = queues[(w + k) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.jobs.empty()) {
+                job = victim.jobs.front();
+                victim.jobs.pop_front();
+                return true;
+            }
+        }
+        return false; // No job is ever added mid-batch, so every queue is done
+    }
+
+    static void work(size_t w, std::vector<Queue>& queues, const std::vector<KiwiJob>& jobs,
+                     std::vector<KiwiJobResult>& results) {
+        auto output = std::make_shared<KiwiStringOutput>();
+        auto errors = std::make_shared<KiwiStringOutput>();
+        auto input = std::make_shared<KiwiLinesInput>();
+        KiwiContext context;
+        context.set_output(output);
+        context.set_error_output(errors);
+        context.set_input(input);
+        KiwiRandom seeds{KiwiContext::fresh_seed()};
+
+        size_t index;
+        while (take(w, queues, index)) {
+            const KiwiJob& job = jobs[index];
+            KiwiJobResult& result = results[index];
+            output->clear();
+            errors->clear();
+            input->assign(job.input);
+            context.seed(job.seed ? *job.seed : seeds.next());
+
+            auto start = std::chrono::steady_clock::now();
+            try {
+                context.set_program(job.program);
+                context.run();
+            } catch (const std::exception& e) {
+                result.ok = false;
+                errors->write(std::string("Error: ") + e.what() + "\n");
+            }
+            result.latency = std::chrono::steady_clock::now() - start;
+            result.output = output->str();
+            result.errors = errors->str();
+        }
+    }
+};
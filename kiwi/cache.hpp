@@ -0,0 +1,296 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "platform.hpp"
+
+#if KIWI_POSIX
+#include <unistd.h>
+#endif
+
+#include "program.hpp"
+#include "source.hpp"
+
+// Compiled programs stored as flat binary images. An image is a header
+// followed by 8-byte aligned sections addressed by offset from its start,
+// so it needs no relocation: record sections are copied out of a mapping
+// as they are, and only strings and the lookup tables are rebuilt.
+class KiwiBytecode {
+public:
+    // 64-bit FNV-1a hash of text
+    static std::uint64_t hash(std::string_view text) {
+        std::uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : text) {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // Binary image of a compiled program
+    static std::string serialize(const KiwiProgram& program) {
+        std::string image(sizeof(Header), '\0');
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof MAGIC);
+        header.version = VERSION;
+        header.layout = layout();
+        header.source_hash = hash(program.source->text());
+        header.source_size = program.source->text().size();
+        header.math_depth = program.math_depth;
+
+        add_records(image, header, Code, program.code);
+        add_records(image, header, Numbers, program.numbers);
+        add_records(image, header, Functions, program.functions);
+        add_records(image, header, CallSites, program.call_sites);
+        add_records(image, header, CallArgs, program.call_args);
+        add_records(image, header, Pieces, program.pieces);
+        add_records(image, header, Templates, program.templates);
+        add_records(image, header, MathOps, program.math_ops);
+        add_records(image, header, Expressions, program.expressions);
+        add_records(image, header, Conditions, program.conditions);
+        add_records(image, header, ForLoops, program.for_loops);
+        add_records(image, header, Elements, program.elements);
+        add_strings(image, header, Operands, program.operands);
+        add_strings(image, header, LocalNames, program.local_names);
+        add_strings(image, header, Names, program.names);
+        add_strings(image, header, Diagnostics, program.warnings);
+
+        header.payload_hash = hash(std::string_view(image).substr(sizeof(Header)));
+        std::memcpy(&image[0], &header, sizeof header);
+        return image;
+    }
+
+    // Program from an image built from exactly this source; nullptr when
+    // the image is stale, damaged or from an incompatible build
+    static std::shared_ptr<const KiwiProgram> deserialize(std::string_view image,
+                                                          std::shared_ptr<const KiwiSource> source) {
+        if (image.size() < sizeof(Header)) return nullptr;
+        Header header;
+        std::memcpy(&header, image.data(), sizeof header);
+        if (std::memcmp(header.magic, MAGIC, sizeof MAGIC) != 0 || header.version != VERSION ||
+            header.layout != layout() || header.source_size != source->text().size() ||
+            header.source_hash != hash(source->text()) ||
+            header.payload_hash != hash(image.substr(sizeof(Header)))) {
+            return nullptr;
+        }
+
+        std::shared_ptr<KiwiProgram> program(new KiwiProgram(std::move(source), KiwiProgram::Precompiled{}));
+        bool ok = read_records(image, header, Code, program->code) &&
+                  read_records(image, header, Numbers, program->numbers) &&
+                  read_records(image, header, Functions, program->functions) &&
+                  read_records(image, header, CallSites, program->call_sites) &&
+                  read_records(image, header, CallArgs, program->call_args) &&
+                  read_records(image, header, Pieces, program->pieces) &&
+                  read_records(image, header, Templates, program->templates) &&
+                  read_records(image, header, MathOps, program->math_ops) &&
+                  read_records(image, header, Expressions, program->expressions) &&
+                  read_records(image, header, Conditions, program->conditions) &&
+                  read_records(image, header, ForLoops, program->for_loops) &&
+                  read_records(image, header, Elements, program->elements) &&
+                  read_strings(image, header, Operands, program->operands) &&
+                  read_strings(image, header, LocalNames, program->local_names) &&
+                  read_strings(image, header, Names, program->names) &&
+                  read_strings(image, header, Diagnostics, program->warnings);
+        if (!ok) return nullptr;
+
+        program->math_depth = static_cast<size_t>(header.math_depth);
+        program->index_names();
+        program->preprocess_functions();
+        return program;
+    }
+
+    // Compile path, or take its compiled form from cache_path when that was
+    // built from the same source. A missing or stale cache is rewritten;
+    // failing to write it is not an error.
+    static std::shared_ptr<const KiwiProgram> load_file(const std::string& path, const std::string& cache_path) {
+        std::shared_ptr<const KiwiSource> source = KiwiSource::from_file(path);
+        try {
+            KiwiMapping cache(cache_path);
+            if (auto program = deserialize(cache.bytes(), source)) return program;
+        } catch (const std::runtime_error&) {
+            // No cache yet
+        }
+        auto program = std::make_shared<const KiwiProgram>(source);
+        write_file(cache_path, serialize(*program));
+        return program;
+    }
+
+private:
+    static constexpr char MAGIC[8] = {'K', 'I', 'W', 'I', 'B', 'C', '\r', '\n'};
+    static constexpr std::uint32_t VERSION = 4;
+
+    enum Section : std::uint32_t {
+        Code, Numbers, Functions, CallSites, CallArgs, Pieces, Templates, MathOps,
+        Expressions, Conditions, ForLoops, Elements, Operands, LocalNames, Names, Diagnostics,
+        SectionCount
+    };
+
+    // Location of a section; for strings, count entries of (count + 1)
+    // offsets precede the character data
+    struct SectionEntry {
+        std::uint64_t offset;
+        std::uint64_t count;
+        std::uint64_t bytes;
+    };
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t layout;       // Fingerprint of record sizes and byte order
+        std::uint64_t source_hash;  // FNV-1a of the source text
+        std::uint64_t source_size;
+        std::uint64_t payload_hash; // FNV-1a of everything after the header
+        std::uint64_t math_depth;
+        SectionEntry sections[SectionCount];
+    };
+
+    // Images are only valid for builds with the same record layout and
+    // opcode numbering; bump VERSION when operand meanings change
+    static std::uint32_t layout() {
+        const std::uint32_t sizes[] = {
+            sizeof(KiwiProgram::Instruction), sizeof(KiwiProgram::Function),
+            sizeof(KiwiProgram::CallSite), sizeof(KiwiProgram::Piece),
+            sizeof(KiwiProgram::Template), sizeof(KiwiProgram::MathOp),
+            sizeof(KiwiProgram::Expression), sizeof(KiwiProgram::Condition),
+            sizeof(KiwiProgram::ForLoop), sizeof(KiwiProgram::Element), 0x01020304u};
+        std::string key(reinterpret_cast<const char*>(sizes), sizeof sizes);
+        for (size_t op = 0; op < static_cast<size_t>(KiwiProgram::OpCode::Count); ++op) {
+            key += KiwiProgram::op_name(static_cast<KiwiProgram::OpCode>(op));
+            key += ' ';
+        }
+        return static_cast<std::uint32_t>(hash(key));
+    }
+
+    static void align(std::string& image) {
+        image.resize((image.size() + 7) & ~size_t(7), '\0');
+    }
+
+    // Records are stored as their raw bytes. Records with padding are
+    // written member by member into zeroed space instead, so no stray
+    // heap bytes reach the image and equal programs give equal images.
+    template <typename T>
+    static void add_records(std::string& image, Header& header, Section section, const std::vector<T>& records) {
+        static_assert(std::is_trivially_copyable<T>::value, "records are stored as raw bytes");
+        align(image);
+        size_t start = image.size();
+        header.sections[section] = {start, records.size(), records.size() * sizeof(T)};
+        if constexpr (std::is_arithmetic<T>::value || std::has_unique_object_representations<T>::value) {
+            image.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(T));
+        } else {
+            image.resize(start + records.size() * sizeof(T), '\0');
+            for (size_t i = 0; i < records.size(); ++i) put(&image[start + i * sizeof(T)], records[i]);
+        }
+    }
+
+    template <typename T>
+    static void put(char* out, const T& value) {
+        static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value,
+                      "records with padding need a put() overload listing their members");
+        std::memcpy(out, &value, sizeof value);
+    }
+
+    // Store each member at its offset within record
+    template <typename T, typename... Members>
+    static void put_members(char* out, const T& record, const Members&... members) {
+        const char* base = reinterpret_cast<const char*>(&record);
+        (put(out + (reinterpret_cast<const char*>(&members) - base), members), ...);
+    }
+
+    static void put(char* out, const KiwiProgram::Instruction& r) {
+        put_members(out, r, r.op, r.line, r.a, r.b, r.c, r.target);
+    }
+
+    static void put(char* out, const KiwiProgram::Piece& r) { put_members(out, r, r.kind, r.index, r.fallback); }
+
+    static void put(char* out, const KiwiProgram::MathOp& r) { put_members(out, r, r.kind, r.index, r.value); }
+
+    static void put(char* out, const KiwiProgram::CondOperand& r) {
+        put_members(out, r, r.kind, r.index, r.fallback, r.numeric, r.number);
+    }
+
+    static void put(char* out, const KiwiProgram::Condition& r) { put_members(out, r, r.op, r.lhs, r.rhs); }
+
+    static void add_strings(std::string& image, Header& header, Section section,
+                            const std::vector<std::string>& strings) {
+        align(image);
+        size_t start = image.size();
+        std::vector<std::uint32_t> offsets;
+        offsets.reserve(strings.size() + 1);
+        std::uint32_t offset = 0;
+        for (const std::string& s : strings) {
+            offsets.push_back(offset);
+            offset += static_cast<std::uint32_t>(s.size());
+        }
+        offsets.push_back(offset);
+        image.append(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(std::uint32_t));
+        for (const std::string& s : strings) image += s;
+        header.sections[section] = {start, strings.size(), image.size() - start};
+    }
+
+    // Bytes of a section; false when the entry points outside the image
+    static bool section_bytes(std::string_view image, const SectionEntry& entry, std::string_view& bytes) {
+        if (entry.offset > image.size() || entry.bytes > image.size() - entry.offset) return false;
+        bytes = image.substr(entry.offset, entry.bytes);
+        return true;
+    }
+
+    template <typename T>
+    static bool read_records(std::string_view image, const Header& header, Section section, std::vector<T>& records) {
+        const SectionEntry& entry = header.sections[section];
+        std::string_view bytes;
+        if (!section_bytes(image, entry, bytes) || entry.bytes != entry.count * sizeof(T)) return false;
+        records.resize(entry.count);
+        if (entry.count) std::memcpy(records.data(), bytes.data(), bytes.size());
+        return true;
+    }
+
+    static bool read_strings(std::string_view image, const Header& header, Section section,
+                             std::vector<std::string>& strings) {
+        const SectionEntry& entry = header.sections[section];
+        std::string_view bytes;
+        size_t table = (entry.count + 1) * sizeof(std::uint32_t);
+        if (!section_bytes(image, entry, bytes) || bytes.size() < table) return false;
+        std::vector<std::uint32_t> offsets(entry.count + 1);
+        std::memcpy(offsets.data(), bytes.data(), table);
+        std::string_view chars = bytes.substr(table);
+        strings.clear();
+        strings.reserve(entry.count);
+        for (size_t i = 0; i < entry.count; ++i) {
+            if (offsets[i] > offsets[i + 1] || offsets[i + 1] > chars.size()) return false;
+            strings.emplace_back(chars.substr(offsets[i], offsets[i + 1] - offsets[i]));
+        }
+        return true;
+    }
+
+    // Replace path atomically so concurrent readers never see a partial image
+    static void write_file(const std::string& path, const std::string& image) {
+#if KIWI_POSIX
+        std::string temp = path + ".tmp" + std::to_string(::getpid());
+#else
+        std::string temp = path + ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+        {
+            std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+            if (!out.write(image.data(), static_cast<std::streamsize>(image.size()))) {
+                out.close();
+                std::remove(temp.c_str());
+                return;
+            }
+        }
+#if !KIWI_POSIX
+        // rename() does not replace an existing file on Windows
+        if (std::rename(temp.c_str(), path.c_str()) == 0) return;
+        std::remove(path.c_str());
+#endif
+        if (std::rename(temp.c_str(), path.c_str()) != 0) std::remove(temp.c_str());
+    }
+};
@@ -0,0 +1,1535 @@
+#pragma once
+
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cmath>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <iomanip>
+#include <array>
+#include <memory>
+#include <random>
+
+#include "arena.hpp"
+#include "input.hpp"
+#include "output.hpp"
+#include "program.hpp"
+#include "random.hpp"
+#include "source.hpp"
+#include "value.hpp"
+
+// Label-address dispatch is a GNU extension and measured no faster than the
+// switch, so it is opt-in: define KIWI_COMPUTED_GOTO and build in a GNU
+// dialect (-std=gnu++17). Strict ISO builds always get the switch.
+#if defined(KIWI_COMPUTED_GOTO) && defined(__GNUC__) && !defined(__STRICT_ANSI__)
+#define KIWI_THREADED_DISPATCH 1
+#else
+#define KIWI_THREADED_DISPATCH 0
+#endif
+
+// Mutable state of one run of a shared KiwiProgram: variables, call frames,
+// output and profile. Contexts are cheap to create and independent of each
+// other; each may run on its own thread.
+class KiwiContext {
+private:
+    using Value = KiwiValue;
+    using OpCode = KiwiProgram::OpCode;
+    using Instruction = KiwiProgram::Instruction;
+    using Piece = KiwiProgram::Piece;
+    using Template = KiwiProgram::Template;
+    using MathOp = KiwiProgram::MathOp;
+    using Expression = KiwiProgram::Expression;
+    using CondOperand = KiwiProgram::CondOperand;
+    using Condition = KiwiProgram::Condition;
+    using Function = KiwiProgram::Function;
+    using CallSite = KiwiProgram::CallSite;
+    using ForLoop = KiwiProgram::ForLoop;
+    using Element = KiwiProgram::Element;
+    using Elements = KiwiValue::Elements;
+
+    static constexpr std::uint32_t NO_TARGET = KiwiProgram::NO_TARGET;
+    static constexpr std::uint32_t DYNAMIC_NAME = KiwiProgram::DYNAMIC_NAME;
+    static constexpr std::uint32_t LOCAL_SLOT = KiwiProgram::LOCAL_SLOT;
+    static constexpr std::uint32_t ELEMENT_REF = KiwiProgram::ELEMENT_REF;
+
+    // Activation record on the frame stack
+    struct Frame {
+        std::uint32_t return_pc;
+        std::uint32_t base;     // First local of this frame
+        std::uint32_t function;
+        std::uint32_t result;   // Caller's target for the return value
+    };
+
+    std::shared_ptr<const KiwiProgram> program; // Shared, never modified
+
+    // Execution state components
+    std::vector<Value> slots;                // Variable storage by slot
+    std::deque<std::string> dynamic_names;   // Names first seen at runtime; addresses are stable
+    std::unordered_map<std::string_view, std::uint32_t> dynamic_slots; // Their slots
+    std::vector<Frame> frames;               // Call frame stack
+    std::vector<Value> locals;               // Frame-local slots, contiguous across frames
+    std::uint32_t frame_base = 0;            // First local of the current frame
+    std::shared_ptr<KiwiOutput> output = std::make_shared<KiwiStreamOutput>(); // Print destination
+    std::shared_ptr<KiwiOutput> errors = std::make_shared<KiwiStreamOutput>(std::cerr); // Diagnostics
+    std::shared_ptr<KiwiInput> input = std::make_shared<KiwiStreamInput>(); // Source of input lines
+
+    // File opened by a script; exactly one side is set while it is open
+    struct File {
+        std::shared_ptr<KiwiInput> reader;
+        std::shared_ptr<KiwiOutput> writer;
+        std::string path; // For write errors
+    };
+    static constexpr size_t FILE_BUFFER = 256 * 1024;
+    std::vector<File> files;                 // By handle - 1; closed entries are empty
+    KiwiRandom rng{fresh_seed()};            // Generator behind random
+    std::string line_buffer;                 // Reused template render buffer
+    std::string compare_buffer;              // Second operand of text comparisons
+    std::string text_buffer;                 // Result of string commands
+    KiwiArena arena;                         // Temporaries of the statement being executed
+    std::vector<double> math_stack;          // Evaluation stack for expressions
+    size_t math_top = 0;                     // First free math_stack entry
+    size_t pc = 0;                           // Next instruction
+    bool exit_requested = false;             // Exit flag
+    bool diagnosed = false;                  // Load-time diagnostics reported
+    Value scratch;                           // Sink for writes to invalid elements
+
+    // Execution count and cumulative time of one line or opcode
+    struct ProfileCounter {
+        std::uint64_t count = 0;
+        std::uint64_t ns = 0;
+    };
+
+    // Opt-in profiler state; untouched unless profiling is enabled
+    bool profiling = false;
+    std::vector<ProfileCounter> line_profile;                         // By source line
+    std::array<ProfileCounter, static_cast<size_t>(OpCode::Count)> opcode_profile{};
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> stack_nodes; // (parent node, function)
+    std::map<std::pair<std::uint32_t, std::uint32_t>, std::uint32_t> stack_children;
+    std::unordered_map<std::uint64_t, std::uint64_t> stack_samples;   // (node, line) -> ns
+    std::uint32_t stack_node = 0;                                     // Node of the current call path
+
+    // Releases the arena temporaries of a scope when it ends. An arena
+    // string must not grow while a nested scope is open, or the nested
+    // rewind would hand its new buffer out again.
+    struct ArenaScope {
+        KiwiArena& arena;
+        KiwiArena::Mark mark;
+        explicit ArenaScope(KiwiArena& arena) : arena(arena), mark(arena.mark()) {}
+        ~ArenaScope() { arena.rewind(mark); }
+    };
+
+    // Append stored value as text
+    template <typename Out>
+    static void append_value(Out& out, const Value& value) {
+        if (value.is_string()) {
+            out += KiwiProgram::value_text(value.text());
+        }
+        else if (value.is_number()) {
+            KiwiProgram::append_number(out, value.number());
+        }
+        else if (value.is_array()) {
+            out += '[';
+            for (size_t i = 0; i < value.elements().size(); ++i) {
+                if (i) out += ", ";
+                append_value(out, value.elements()[i]);
+            }
+            out += ']';
+        }
+        else if (value.is_dict()) {
+            out += '{';
+            bool first = true;
+            for (const KiwiDict::Entry& entry : value.dict().entries()) {
+                if (entry.removed) continue;
+                if (!first) out += ", ";
+                first = false;
+                out += entry.key;
+                out += ": ";
+                append_value(out, entry.value);
+            }
+            out += '}';
+        }
+    }
+
+    // Slot of a variable name, or nullptr when it was never assigned
+    Value* find_variable(std::string_view name) {
+        auto it = program->name_index.find(name);
+        if (it == program->name_index.end()) {
+            it = dynamic_slots.find(name);
+            if (it == dynamic_slots.end()) return nullptr;
+        }
+        Value& value = slots[it->second];
+        return value.is_unset() ? nullptr : &value;
+    }
+
+    // Variable named by a rendered template, or nullptr when unset
+    Value* find_dynamic(std::uint32_t index) {
+        ArenaScope scope(arena);
+        KiwiArenaString name{KiwiArenaAllocator<char>(&arena)};
+        render(index, name);
+        return find_variable(name);
+    }
+
+    // Storage of a global or frame-local slot reference
+    Value& slot(std::uint32_t ref) {
+        return (ref & LOCAL_SLOT) ? locals[frame_base + (ref & ~LOCAL_SLOT)] : slots[ref];
+    }
+
+    // Name of a slot reference for diagnostics
+    const std::string& slot_name(std::uint32_t ref) {
+        if (!(ref & LOCAL_SLOT)) return program->names[ref];
+        return program->local_names[program->functions[frames.back().function].first_local + (ref & ~LOCAL_SLOT)];
+    }
+
+    // Element i of an array value, or nullptr when it is not an array or
+    // i is not an index into it
+    static const Value* element_at(const Value& array, double i) {
+        if (!array.is_array() || !(i >= 0) || i >= array.elements().size() || i != std::floor(i)) return nullptr;
+        return &array.elements()[static_cast<size_t>(i)];
+    }
+
+    // Element read through a[i], or nullptr when there is none
+    const Value* find_element(std::uint32_t index) {
+        const Element& element = program->elements[index];
+        double i;
+        try {
+            i = evaluate_math_expression(element.index);
+        } catch (const std::exception&) {
+            return nullptr;
+        }
+        return element_at(slot(element.array), i);
+    }
+
+    // Numeric value of element i of an array as a math operand
+    double element_operand(const Value* value, std::uint32_t array, double i) {
+        std::string name = slot_name(array) + '[';
+        KiwiProgram::append_number(name, i);
+        return numeric_operand(value, name + ']');
+    }
+
+    // Element a[i] as an assignment target. An unset variable becomes an
+    // array, and i may be one past the end to append; invalid targets are
+    // reported and the write goes to a scratch value.
+    Value& element_target(std::uint32_t index) {
+        const Element& element = program->elements[index];
+        double i;
+        try {
+            i = evaluate_math_expression(element.index);
+        } catch (const std::exception& e) {
+            report(std::string("Math error: ") + e.what());
+            scratch.clear();
+            return scratch;
+        }
+        Elements* items = array_operand(element.array, true);
+        if (items && i >= 0 && i <= items->size() && i == std::floor(i)) {
+            if (i == items->size()) items->emplace_back();
+            return (*items)[static_cast<size_t>(i)];
+        }
+        if (items) {
+            std::string message = "Error: Index ";
+            KiwiProgram::append_number(message, i);
+            report(message + " out of range for '" + slot_name(element.array) + "'");
+        }
+        scratch.clear();
+        return scratch;
+    }
+
+    // Elements of an array variable; an unset one becomes an empty array
+    // when create is set, anything else is reported and gives nullptr
+    Elements* array_operand(std::uint32_t ref, bool create) {
+        Value& value = slot(ref);
+        if (value.is_array()) return &value.elements();
+        if (create && value.is_unset()) return &value.make_array();
+        report("Error: '" + slot_name(ref) + "' is not an array");
+        return nullptr;
+    }
+
+    // Table held by a dict variable; an unset one becomes an empty dict
+    // when create is set, anything else is reported and gives nullptr
+    KiwiDict* dict_operand(std::uint32_t ref, bool create) {
+        Value& value = slot(ref);
+        if (value.is_dict()) return &value.dict();
+        if (create && value.is_unset()) return &value.make_dict();
+        report("Error: '" + slot_name(ref) + "' is not a dict");
+        return nullptr;
+    }
+
+    // Storage for an assignment target; dynamic names are resolved by hash
+    Value& target(std::uint32_t ref) {
+        if (!(ref & (DYNAMIC_NAME | ELEMENT_REF))) return slot(ref);
+        if (ref & ELEMENT_REF) return element_target(ref & ~ELEMENT_REF);
+        ArenaScope scope(arena);
+        KiwiArenaString name{KiwiArenaAllocator<char>(&arena)};
+        render(ref & ~DYNAMIC_NAME, name);
+        auto it = program->name_index.find(name);
+        if (it != program->name_index.end()) return slots[it->second];
+        it = dynamic_slots.find(name);
+        if (it != dynamic_slots.end()) return slots[it->second];
+        dynamic_names.emplace_back(name);
+        dynamic_slots.emplace(dynamic_names.back(), static_cast<std::uint32_t>(slots.size()));
+        return slots.emplace_back();
+    }
+
+    // Append a rendered template to out in a single pass
+    template <typename Out>
+    void render(std::uint32_t index, Out& out) {
+        const Template& tpl = program->templates[index];
+        out.reserve(out.size() + tpl.literal_size);
+        for (std::uint32_t i = tpl.first; i < tpl.first + tpl.count; ++i) {
+            const Piece& piece = program->pieces[i];
+            switch (piece.kind) {
+            case Piece::Literal:
+                out += program->operands[piece.index];
+                break;
+            case Piece::Variable:
+                append_value(out, slot(piece.index));
+                break;
+            case Piece::DynamicVariable:
+                if (const Value* value = find_dynamic(piece.index)) append_value(out, *value);
+                break;
+            case Piece::Element:
+                if (const Value* value = find_element(piece.index)) append_value(out, *value);
+                break;
+            case Piece::Expression:
+                try {
+                    KiwiProgram::append_number(out, evaluate_math_expression(piece.index));
+                } catch (...) {
+                    out += program->operands[piece.fallback];
+                }
+                break;
+            }
+        }
+    }
+
+    // Render a template into the reused line buffer
+    const std::string& render(std::uint32_t index) {
+        line_buffer.clear();
+        render(index, line_buffer);
+        return line_buffer;
+    }
+
+    // Assign a template's value; a lone {{var}} or {{a[i]}} copies the
+    // value as is and a lone <expr> stores its number, while other text is
+    // stored as a number only when it prints back unchanged
+    void assign(Value& dst, std::uint32_t index) {
+        const Template& tpl = program->templates[index];
+        if (tpl.count == 1 && program->pieces[tpl.first].kind == Piece::Variable) {
+            dst = slot(program->pieces[tpl.first].index);
+            return;
+        }
+        if (tpl.count == 1 && program->pieces[tpl.first].kind == Piece::Element) {
+            if (const Value* value = find_element(program->pieces[tpl.first].index)) dst = *value;
+            else dst.clear();
+            return;
+        }
+        if (tpl.count == 1 && program->pieces[tpl.first].kind == Piece::Expression) {
+            try {
+                dst = evaluate_math_expression(program->pieces[tpl.first].index);
+                return;
+            } catch (...) {
+                // Rendered below as the expression's fallback text
+            }
+        }
+        const std::string& text = render(index);
+        double num;
+        if (KiwiProgram::try_parse_exact_number(text, num)) {
+            dst = num;
+        } else {
+            dst.set_text(KiwiProgram::value_text(text));
+        }
+    }
+
+    // Numeric value of a variable used as a math operand
+    static double numeric_operand(const Value* value, std::string_view name) {
+        if (!value || value->is_unset()) {
+            throw std::runtime_error("Undefined variable: " + std::string(name));
+        }
+        if (value->is_number()) return value->number();
+        double num;
+        if (!KiwiProgram::try_parse_number(value->text(), num)) {
+            throw std::runtime_error("Variable '" + std::string(name) + "' is not a number");
+        }
+        return num;
+    }
+
+    // Numeric value of a variable named by a rendered template
+    double dynamic_operand(std::uint32_t index) {
+        ArenaScope scope(arena);
+        KiwiArenaString name{KiwiArenaAllocator<char>(&arena)};
+        render(index, name);
+        return numeric_operand(find_variable(name), name);
+    }
+
+    // Run a compiled expression on the evaluation stack
+    double evaluate_math_expression(std::uint32_t index) {
+        const Expression& expr = program->expressions[index];
+        // Nested evaluations (through dynamic names) stack above this one
+        struct Frame {
+            size_t& top;
+            size_t base;
+            ~Frame() { top = base; }
+        } frame{math_top, math_top};
+        if (frame.base + expr.depth > math_stack.size()) math_stack.resize(frame.base + expr.depth);
+        math_top = frame.base + expr.depth;
+        double* sp = math_stack.data() + frame.base;
+        for (std::uint32_t i = expr.first; i < expr.first + expr.count; ++i) {
+            const MathOp& op = program->math_ops[i];
+            switch (op.kind) {
+            case MathOp::Const:
+                *sp++ = op.value;
+                break;
+            case MathOp::Load: {
+                const Value& value = slot(op.index);
+                *sp++ = value.is_number() ? value.number() : numeric_operand(&value, slot_name(op.index));
+                break;
+            }
+            case MathOp::LoadDynamic: {
+                size_t offset = sp - math_stack.data();
+                double value = dynamic_operand(op.index);
+                sp = math_stack.data() + offset; // Rendering may grow the stack
+                *sp++ = value;
+                break;
+            }
+            case MathOp::LoadElement: {
+                const Value* value = element_at(slot(op.index), sp[-1]);
+                sp[-1] = value && value->is_number() ? value->number() : element_operand(value, op.index, sp[-1]);
+                break;
+            }
+            case MathOp::Add: sp--; sp[-1] += *sp; break;
+            case MathOp::Sub: sp--; sp[-1] -= *sp; break;
+            case MathOp::Mul: sp--; sp[-1] *= *sp; break;
+            case MathOp::Div:
+                sp--;
+                if (*sp == 0) throw std::runtime_error("Division by zero");
+                sp[-1] /= *sp;
+                break;
+            case MathOp::Pow: sp--; sp[-1] = std::pow(sp[-1], *sp); break;
+            case MathOp::Neg: sp[-1] = -sp[-1]; break;
+            }
+        }
+        return math_stack[frame.base];
+    }
+
+    // Condition operand resolved to its number (when it has one) and text
+    struct Resolved {
+        bool numeric;
+        double number;
+        bool has_text;
+        std::string_view text;
+    };
+
+    Resolved resolve(const CondOperand& operand, std::string& buffer) {
+        switch (operand.kind) {
+        case CondOperand::Literal:
+            return {operand.numeric, operand.number, true, program->operands[operand.index]};
+        case CondOperand::Variable: {
+            const Value& value = slot(operand.index);
+            if (value.is_number()) return {true, value.number(), false, {}};
+            if (value.is_string()) {
+                std::string_view text = KiwiProgram::value_text(value.text());
+                double num = 0;
+                bool numeric = KiwiProgram::try_parse_number(text, num);
+                return {numeric, num, true, text};
+            }
+            if (operand.fallback != NO_TARGET) return {false, 0, true, program->operands[operand.fallback]};
+            return {false, 0, true, {}};
+        }
+        case CondOperand::Template: {
+            buffer.clear();
+            render(operand.index, buffer);
+            double num = 0;
+            bool numeric = KiwiProgram::try_parse_number(buffer, num);
+            return {numeric, num, true, buffer};
+        }
+        }
+        return {false, 0, true, {}};
+    }
+
+    // Evaluate a compiled condition; numbers compare as doubles, the rest as text
+    bool evaluate_condition(std::uint32_t index) {
+        const Condition& cond = program->conditions[index];
+        Resolved lhs = resolve(cond.lhs, line_buffer);
+        if (cond.op == Condition::Truth) {
+            return lhs.numeric ? lhs.number != 0 : lhs.text == "true";
+        }
+        Resolved rhs = resolve(cond.rhs, compare_buffer);
+
+        int order;
+        if (lhs.numeric && rhs.numeric) {
+            order = lhs.number < rhs.number ? -1 : lhs.number > rhs.number ? 1 : 0;
+            if (order == 0 && lhs.number != rhs.number) return cond.op == Condition::Ne; // NaN
+        } else {
+            if (!lhs.has_text) {
+                line_buffer.clear();
+                KiwiProgram::append_number(line_buffer, lhs.number);
+                lhs.text = line_buffer;
+            }
+            if (!rhs.has_text) {
+                compare_buffer.clear();
+                KiwiProgram::append_number(compare_buffer, rhs.number);
+                rhs.text = compare_buffer;
+            }
+            order = lhs.text.compare(rhs.text);
+        }
+        switch (cond.op) {
+            case Condition::Eq: return order == 0;
+            case Condition::Ne: return order != 0;
+            case Condition::Lt: return order < 0;
+            case Condition::Gt: return order > 0;
+            case Condition::Le: return order <= 0;
+            case Condition::Ge: return order >= 0;
+            default: return false;
+        }
+    }
+
+public:
+    explicit KiwiContext(std::shared_ptr<const KiwiProgram> program = std::make_shared<const KiwiProgram>())
+        : program(std::move(program)) {
+        reset();
+    }
+
+    // Switch to another program; variables are cleared
+    void set_program(std::shared_ptr<const KiwiProgram> next) {
+        program = std::move(next);
+        diagnosed = false;
+        reset();
+        if (profiling) clear_profile();
+    }
+
+    const std::shared_ptr<const KiwiProgram>& get_program() const { return program; }
+
+    // Clear variables and start over from the first line of the loaded script
+    void reset() {
+        pc = 0;
+        exit_requested = false;
+        frames.clear();
+        locals.clear();
+        frame_base = 0;
+        slots.assign(program->names.size(), Value());
+        math_stack.assign(std::max<size_t>(program->math_depth, 1), 0);
+        math_top = 0;
+        dynamic_slots.clear();
+        dynamic_names.clear();
+        files.clear(); // Flushes and closes what the script left open
+        arena.reset();
+        stack_node = 0;
+    }
+
+    // Main execution loop; output is flushed when the script ends
+    void run() {
+        if (!diagnosed) {
+            for (const std::string& message : program->diagnostics()) report(message);
+            diagnosed = true;
+        }
+        if (profiling) {
+            run_loop<true>();
+        } else {
+            run_loop<false>();
+        }
+        for (File& file : files) {
+            if (file.writer) finish_writes(file, false);
+        }
+        output->flush();
+    }
+
+    // Send print output to a sink instead of std::cout
+    void set_output(std::shared_ptr<KiwiOutput> sink) {
+        if (output) output->flush();
+        output = std::move(sink);
+    }
+
+    KiwiOutput& get_output() { return *output; }
+
+    // Send runtime diagnostics to a sink instead of std::cerr
+    void set_error_output(std::shared_ptr<KiwiOutput> sink) {
+        if (errors) errors->flush();
+        errors = std::move(sink);
+    }
+
+    // Read input lines from a source instead of std::cin
+    void set_input(std::shared_ptr<KiwiInput> source) { input = std::move(source); }
+
+    // Restart the random sequence; equal seeds give equal sequences
+    void seed(std::uint64_t value) { rng.seed(value); }
+
+    // Unpredictable seed for generators nobody seeded. Seeds come from a
+    // per-thread generator, so std::random_device is opened once per
+    // thread rather than once per context.
+    static std::uint64_t fresh_seed() {
+        thread_local KiwiRandom seeds([] {
+            std::random_device device;
+            return (static_cast<std::uint64_t>(device()) << 32) ^ device();
+        }());
+        return seeds.next();
+    }
+
+    // Record per-line and per-command counts and time on later runs
+    void enable_profiling(bool enabled = true) {
+        profiling = enabled;
+        if (enabled && line_profile.size() != program->lines().size()) clear_profile();
+    }
+
+    // Drop collected profile data
+    void clear_profile() {
+        line_profile.assign(program->lines().size(), ProfileCounter());
+        opcode_profile.fill(ProfileCounter());
+        stack_nodes.assign(1, {0, NO_TARGET});
+        stack_children.clear();
+        stack_samples.clear();
+        stack_node = 0;
+    }
+
+    // Write lines and commands sorted by cumulative time
+    void write_profile_report(std::ostream& out) const {
+        std::uint64_t total_ns = 0, total_count = 0;
+        for (const ProfileCounter& c : opcode_profile) {
+            total_ns += c.ns;
+            total_count += c.count;
+        }
+        auto print_row = [&](const ProfileCounter& c, const std::string& label) {
+            out << std::setw(12) << c.count << std::setw(12) << std::fixed << std::setprecision(3)
+                << c.ns / 1e6 << std::setw(8) << std::setprecision(1)
+                << (total_ns ? 100.0 * c.ns / total_ns : 0.0) << "%  " << label << '\n';
+        };
+
+        out << "Kiwi profile: " << total_count << " instructions, " << std::fixed
+            << std::setprecision(3) << total_ns / 1e6 << " ms\n\n";
+        out << std::setw(12) << "count" << std::setw(12) << "ms" << std::setw(9) << "time" << "  line\n";
+        std::vector<size_t> lines;
+        for (size_t i = 0; i < line_profile.size(); ++i) {
+            if (line_profile[i].count) lines.push_back(i);
+        }
+        std::sort(lines.begin(), lines.end(), [&](size_t a, size_t b) {
+            return line_profile[a].ns > line_profile[b].ns;
+        });
+        for (size_t i : lines) {
+            print_row(line_profile[i], std::to_string(i + 1) + ": " + std::string(KiwiProgram::trim(program->lines()[i])));
+        }
+
+        out << '\n' << std::setw(12) << "count" << std::setw(12) << "ms" << std::setw(9) << "time" << "  command\n";
+        std::vector<size_t> ops;
+        for (size_t i = 0; i < opcode_profile.size(); ++i) {
+            if (opcode_profile[i].count) ops.push_back(i);
+        }
+        std::sort(ops.begin(), ops.end(), [&](size_t a, size_t b) {
+            return opcode_profile[a].ns > opcode_profile[b].ns;
+        });
+        for (size_t i : ops) {
+            print_row(opcode_profile[i], KiwiProgram::op_name(static_cast<OpCode>(i)));
+        }
+    }
+
+    // Write call-path samples in the folded-stack format read by flamegraph.pl;
+    // each sample is the self time in nanoseconds of one line under one call path
+    void write_folded_stacks(std::ostream& out) const {
+        for (const auto& sample : stack_samples) {
+            std::vector<std::string> path;
+            for (std::uint32_t node = static_cast<std::uint32_t>(sample.first >> 32); node != 0;
+                 node = stack_nodes[node].first) {
+                path.push_back(program->operands[program->functions[stack_nodes[node].second].name]);
+            }
+            out << "script";
+            for (auto it = path.rbegin(); it != path.rend(); ++it) out << ';' << *it;
+            std::uint32_t line = static_cast<std::uint32_t>(sample.first);
+            out << ";line " << line + 1 << ' ' << sample.second << '\n';
+        }
+    }
+
+private:
+    // Account one executed instruction and follow calls and returns
+    void record_profile(const Instruction& ins, std::uint64_t ns, size_t depth) {
+        ProfileCounter& line = line_profile[ins.line];
+        line.count++;
+        line.ns += ns;
+        ProfileCounter& op = opcode_profile[static_cast<size_t>(ins.op)];
+        op.count++;
+        op.ns += ns;
+        stack_samples[(static_cast<std::uint64_t>(stack_node) << 32) | ins.line] += ns;
+
+        if (frames.size() > depth) {
+            auto key = std::make_pair(stack_node, frames.back().function);
+            auto it = stack_children.find(key);
+            if (it == stack_children.end()) {
+                it = stack_children.emplace(key, static_cast<std::uint32_t>(stack_nodes.size())).first;
+                stack_nodes.push_back(key);
+            }
+            stack_node = it->second;
+        } else if (frames.size() < depth) {
+            stack_node = stack_nodes[stack_node].first;
+        }
+    }
+
+    // Pop the current frame and hand the result to the caller
+    void return_from_call(Value result) {
+        Frame frame = frames.back();
+        frames.pop_back();
+        locals.resize(frame.base);
+        frame_base = frames.empty() ? 0 : frames.back().base;
+        pc = frame.return_pc;
+        if (frame.result != NO_TARGET) target(frame.result) = std::move(result);
+    }
+
+    // Assign a math expression, reporting failures
+    void math(std::uint32_t dst, std::uint32_t expr) {
+        try {
+            target(dst) = evaluate_math_expression(expr);
+        } catch (const std::exception& e) {
+            report(std::string("Math error: ") + e.what());
+        }
+    }
+
+    // Add a constant to a number in place; anything else takes the
+    // instruction's general expression
+    void increment(const Instruction& ins) {
+        Value& value = slot(ins.a);
+        if (value.is_number()) {
+            value.set_number(value.number() + program->numbers[ins.c]);
+        } else {
+            math(ins.a, ins.b);
+        }
+    }
+
+    // Compare a variable with a number; non-numbers take the general path
+    bool compare(std::uint32_t index) {
+        const Condition& cond = program->conditions[index];
+        const Value& value = slot(cond.lhs.index);
+        if (!value.is_number()) return evaluate_condition(index);
+        double x = value.number(), y = cond.rhs.number;
+        switch (cond.op) {
+            case Condition::Eq: return x == y;
+            case Condition::Ne: return x != y;
+            case Condition::Lt: return x < y;
+            case Condition::Gt: return x > y;
+            case Condition::Le: return x <= y;
+            case Condition::Ge: return x >= y;
+            default: return false;
+        }
+    }
+
+    // Evaluate a for header once and set its counter; false when the loop
+    // runs no iterations
+    bool enter_for(const ForLoop& loop) {
+        if (loop.array != NO_TARGET) {
+            if (!slot(loop.array).is_array() && !slot(loop.array).is_dict()) {
+                report("Error: '" + slot_name(loop.array) + "' is not an array or dict");
+                return false;
+            }
+            return next_element(loop, 0);
+        }
+        double start, limit, step = 1;
+        try {
+            start = evaluate_math_expression(loop.start);
+            limit = evaluate_math_expression(loop.limit);
+            if (loop.step != NO_TARGET) step = evaluate_math_expression(loop.step);
+        } catch (const std::exception& e) {
+            report(std::string("Math error: ") + e.what());
+            return false;
+        }
+        if (step == 0 || std::isnan(step)) {
+            report("Math error: 'for' step must be a non-zero number");
+            return false;
+        }
+        slot(loop.limit_slot).set_number(limit);
+        slot(loop.step_slot).set_number(step);
+        slot(loop.counter).set_number(start);
+        return step > 0 ? start <= limit : start >= limit;
+    }
+
+    // Step a for counter; false once it passes the limit. The body may
+    // have assigned the counter, so a non-number is converted first.
+    bool next_for(const ForLoop& loop) {
+        if (loop.array != NO_TARGET) {
+            return next_element(loop, static_cast<size_t>(slot(loop.limit_slot).number()) + 1);
+        }
+        Value& counter = slot(loop.counter);
+        double value;
+        if (counter.is_number()) {
+            value = counter.number();
+        } else {
+            try {
+                value = numeric_operand(&counter, slot_name(loop.counter));
+            } catch (const std::exception& e) {
+                report(std::string("Math error: ") + e.what());
+                return false;
+            }
+        }
+        double step = slot(loop.step_slot).number();
+        value += step;
+        counter.set_number(value);
+        double limit = slot(loop.limit_slot).number();
+        return step > 0 ? value <= limit : value >= limit;
+    }
+
+    // Copy element i of a for-in array, or the first key of a dict from
+    // entry i on, into the loop variable; false past the end, which the
+    // body may have moved by changing the array or dict
+    bool next_element(const ForLoop& loop, size_t i) {
+        const Value& array = slot(loop.array);
+        if (array.is_dict()) {
+            const std::vector<KiwiDict::Entry>& entries = array.dict().entries();
+            while (i < entries.size() && entries[i].removed) i++;
+            if (i >= entries.size()) return false;
+            slot(loop.limit_slot).set_number(static_cast<double>(i));
+            slot(loop.counter) = std::string_view(entries[i].key);
+            return true;
+        }
+        if (!array.is_array() || i >= array.elements().size()) return false;
+        slot(loop.limit_slot).set_number(static_cast<double>(i));
+        slot(loop.counter) = array.elements()[i];
+        return true;
+    }
+
+    // Length of a rendered template; a lone array or dict variable gives
+    // its size
+    double length(std::uint32_t index) {
+        const Template& tpl = program->templates[index];
+        if (tpl.count == 1 && program->pieces[tpl.first].kind == Piece::Variable) {
+            const Value& value = slot(program->pieces[tpl.first].index);
+            if (value.is_array()) return static_cast<double>(value.elements().size());
+            if (value.is_dict()) return static_cast<double>(value.dict().size());
+        }
+        return static_cast<double>(render(index).length());
+    }
+
+    // Sum, minimum or maximum of an array's elements as numbers
+    void reduce(const Instruction& ins) {
+        const Elements* items = array_operand(ins.b, false);
+        if (!items) return;
+        if (items->empty() && ins.op != OpCode::Sum) {
+            report(std::string("Math error: '") + KiwiProgram::op_name(ins.op) + "' of an empty array");
+            return;
+        }
+        double result = 0;
+        try {
+            for (size_t i = 0; i < items->size(); ++i) {
+                const Value& item = (*items)[i];
+                double x = item.is_number() ? item.number() : element_operand(&item, ins.b, static_cast<double>(i));
+                if (ins.op == OpCode::Sum) result += x;
+                else if (i == 0 || (ins.op == OpCode::Min ? x < result : x > result)) result = x;
+            }
+        } catch (const std::exception& e) {
+            report(std::string("Math error: ") + e.what());
+            return;
+        }
+        target(ins.a) = result;
+    }
+
+    // Store the next line of source in dst; false at end of input
+    bool read_line(std::uint32_t dst, KiwiInput& source) {
+        std::string_view line;
+        if (!source.next_line(line)) return false;
+        target(dst) = line;
+        return true;
+    }
+
+    // Open file behind the handle in a variable; anything else is reported
+    // and gives nullptr
+    File* file_operand(std::uint32_t ref) {
+        const Value& value = slot(ref);
+        if (value.is_number() && value.number() >= 1 && value.number() <= files.size() &&
+            value.number() == std::floor(value.number())) {
+            File& file = files[static_cast<size_t>(value.number()) - 1];
+            if (file.reader || file.writer) return &file;
+        }
+        report("Error: '" + slot_name(ref) + "' is not an open file");
+        return nullptr;
+    }
+
+    // Script input, or the reader of an open file handle
+    KiwiInput* line_source(std::uint32_t file) {
+        if (file == NO_TARGET) return input.get();
+        File* open = file_operand(file);
+        if (!open) return nullptr;
+        if (!open->reader) {
+            report("Error: '" + slot_name(file) + "' is not open for reading");
+            return nullptr;
+        }
+        return open->reader.get();
+    }
+
+    // open file path mode stores a handle, reusing closed ones
+    void open_file(const Instruction& ins) {
+        std::string path = render(ins.b);
+        File file;
+        try {
+            bool append = ins.c == KiwiProgram::AppendFile;
+#if KIWI_POSIX
+            if (ins.c == KiwiProgram::ReadFile) file.reader = KiwiFdInput::open(path, FILE_BUFFER);
+            else file.writer = KiwiFdOutput::open(path, append, FILE_BUFFER);
+#else
+            if (ins.c == KiwiProgram::ReadFile) file.reader = KiwiStreamInput::open(path);
+            else file.writer = KiwiStreamOutput::open(path, append, FILE_BUFFER);
+#endif
+        } catch (const std::runtime_error& e) {
+            report(std::string("Error: ") + e.what());
+            target(ins.a).clear();
+            return;
+        }
+        if (file.writer) file.path = std::move(path);
+        size_t handle = 0;
+        while (handle < files.size() && (files[handle].reader || files[handle].writer)) handle++;
+        if (handle == files.size()) files.emplace_back();
+        files[handle] = std::move(file);
+        target(ins.a) = static_cast<double>(handle + 1);
+    }
+
+    // Flush a script's writer, or close it, and report writes that failed
+    void finish_writes(File& file, bool close) {
+        if (close) file.writer->close();
+        else file.writer->flush();
+        if (int error = file.writer->take_error()) {
+            report("Error: Cannot write '" + file.path + "': " + std::strerror(error));
+        }
+    }
+
+    // write file text appends text and a newline
+    void write_file(const Instruction& ins) {
+        File* file = file_operand(ins.a);
+        if (!file) return;
+        if (!file->writer) {
+            report("Error: '" + slot_name(ins.a) + "' is not open for writing");
+            return;
+        }
+        render(ins.b);
+        line_buffer += '\n';
+        file->writer->write(line_buffer);
+    }
+
+    // slurp var path stores a whole file, copied once out of its mapping
+    void slurp(const Instruction& ins) {
+        try {
+            KiwiMapping mapping(render(ins.b));
+            target(ins.a) = mapping.bytes();
+        } catch (const std::runtime_error& e) {
+            report(std::string("Error: ") + e.what());
+        }
+    }
+
+    // Text of a template, viewed in place when it is a literal or a lone
+    // string variable and rendered into buffer otherwise
+    std::string_view text_operand(std::uint32_t index, std::string& buffer) {
+        const Template& tpl = program->templates[index];
+        if (tpl.count == 1) {
+            const Piece& piece = program->pieces[tpl.first];
+            if (piece.kind == Piece::Literal) return program->operands[piece.index];
+            if (piece.kind == Piece::Variable && slot(piece.index).is_string()) {
+                return KiwiProgram::value_text(slot(piece.index).text());
+            }
+        }
+        buffer.clear();
+        render(index, buffer);
+        return buffer;
+    }
+
+    // Position of needle in text at or after from, or npos. Single bytes
+    // go to memchr and longer needles to memmem, which both scan with the
+    // C library's vectorized loops. memmem is a GNU and BSD extension, so
+    // other systems search with string_view::find.
+    static size_t find_text(std::string_view text, std::string_view needle, size_t from = 0) {
+        if (from > text.size()) return std::string_view::npos;
+        if (needle.empty()) return from;
+#if KIWI_POSIX
+        const void* hit = needle.size() == 1
+            ? std::memchr(text.data() + from, needle[0], text.size() - from)
+            : ::memmem(text.data() + from, text.size() - from, needle.data(), needle.size());
+        return hit ? static_cast<const char*>(hit) - text.data() : std::string_view::npos;
+#else
+        return text.find(needle, from);
+#endif
+    }
+
+    // Broken-down local time through the thread-safe localtime_r on POSIX
+    // and localtime_s on Windows
+    static std::tm local_time(std::time_t when) {
+        std::tm result{};
+#if KIWI_POSIX
+        localtime_r(&when, &result);
+#elif defined(_WIN32)
+        localtime_s(&result, &when);
+#else
+        if (const std::tm* shared = std::localtime(&when)) result = *shared;
+#endif
+        return result;
+    }
+
+    static bool is_blank(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+    }
+
+    // split var text [separator] stores the pieces as an array; without a
+    // separator the text splits on runs of whitespace. An array already in
+    // var is refilled in place to keep its storage.
+    void split(const Instruction& ins) {
+        Value& dst = target(ins.a);
+        std::string_view text = text_operand(ins.b, line_buffer);
+        std::string_view separator;
+        if (ins.c != NO_TARGET) {
+            separator = text_operand(ins.c, compare_buffer);
+            if (separator.empty()) {
+                report("Error: 'split' separator is empty");
+                return;
+            }
+        }
+        Value array; // Built aside when text may live in dst
+        Elements& items = dst.is_array() ? dst.elements() : array.make_array();
+        items.clear();
+        if (separator.empty()) {
+            size_t i = 0;
+            for (;;) {
+                while (i < text.size() && is_blank(text[i])) i++;
+                if (i == text.size()) break;
+                size_t start = i;
+                while (i < text.size() && !is_blank(text[i])) i++;
+                items.emplace_back(text.substr(start, i - start));
+            }
+        } else {
+            size_t start = 0;
+            for (size_t hit; (hit = find_text(text, separator, start)) != std::string_view::npos;
+                 start = hit + separator.size()) {
+                items.emplace_back(text.substr(start, hit - start));
+            }
+            items.emplace_back(text.substr(start));
+        }
+        if (!dst.is_array()) dst = std::move(array);
+    }
+
+    // find var text needle stores the byte offset of the first match, or -1
+    void find(const Instruction& ins) {
+        Value& dst = target(ins.a);
+        std::string_view text = text_operand(ins.b, line_buffer);
+        size_t hit = find_text(text, text_operand(ins.c, compare_buffer));
+        dst = hit == std::string_view::npos ? -1.0 : static_cast<double>(hit);
+    }
+
+    // substr var text start [length]; both bounds are clamped to the text
+    void substr(const Instruction& ins) {
+        double start, length = HUGE_VAL;
+        try {
+            start = evaluate_math_expression(program->call_args[ins.c]);
+            if (program->call_args[ins.c + 1] != NO_TARGET) {
+                length = evaluate_math_expression(program->call_args[ins.c + 1]);
+            }
+        } catch (const std::exception& e) {
+            report(std::string("Math error: ") + e.what());
+            return;
+        }
+        Value& dst = target(ins.a);
+        std::string_view text = text_operand(ins.b, line_buffer);
+        double size = static_cast<double>(text.size());
+        start = start > 0 ? std::min(std::floor(start), size) : 0;
+        length = length > 0 ? std::min(std::floor(length), size - start) : 0;
+        dst = text.substr(static_cast<size_t>(start), static_cast<size_t>(length));
+    }
+
+    // replace var text old new replaces every occurrence of old
+    void replace(const Instruction& ins) {
+        Value& dst = target(ins.a);
+        std::string_view text = text_operand(ins.b, line_buffer);
+        std::string_view from = text_operand(program->call_args[ins.c], compare_buffer);
+        if (from.empty()) {
+            dst = text;
+            return;
+        }
+        ArenaScope scope(arena);
+        KiwiArenaString to{KiwiArenaAllocator<char>(&arena)};
+        render(program->call_args[ins.c + 1], to);
+        text_buffer.clear();
+        size_t start = 0;
+        for (size_t hit; (hit = find_text(text, from, start)) != std::string_view::npos;
+             start = hit + from.size()) {
+            text_buffer.append(text.data() + start, hit - start);
+            text_buffer.append(to.data(), to.size());
+        }
+        text_buffer.append(text.data() + start, text.size() - start);
+        dst = std::string_view(text_buffer);
+    }
+
+    // upper and lower change the case of ASCII letters
+    void change_case(const Instruction& ins) {
+        Value& dst = target(ins.a);
+        std::string_view text = text_operand(ins.b, line_buffer);
+        char first = ins.op == OpCode::Upper ? 'a' : 'A';
+        text_buffer.assign(text.data(), text.size());
+        for (char& c : text_buffer) {
+            if (static_cast<unsigned char>(c - first) < 26) c ^= 0x20;
+        }
+        dst = std::string_view(text_buffer);
+    }
+
+    // trim var text drops whitespace at both ends
+    void trim(const Instruction& ins) {
+        Value& dst = target(ins.a);
+        std::string_view text = text_operand(ins.b, line_buffer);
+        size_t start = 0, end = text.size();
+        while (start < end && is_blank(text[start])) start++;
+        while (end > start && is_blank(text[end - 1])) end--;
+        dst = text.substr(start, end - start);
+    }
+
+    // join var array [separator] concatenates the elements as printed,
+    // separated by a space unless a separator is given
+    void join(const Instruction& ins) {
+        const Elements* items = array_operand(ins.b, false);
+        if (!items) return;
+        std::string_view separator = ins.c == NO_TARGET ? std::string_view(" ") : text_operand(ins.c, compare_buffer);
+        text_buffer.clear();
+        for (size_t i = 0; i < items->size(); ++i) {
+            if (i) text_buffer.append(separator.data(), separator.size());
+            append_value(text_buffer, (*items)[i]);
+        }
+        target(ins.a) = std::string_view(text_buffer);
+    }
+
+    // seed value; the number is taken as a signed 64-bit integer
+    void seed_from(std::uint32_t expr) {
+        double value;
+        try {
+            value = evaluate_math_expression(expr);
+        } catch (const std::exception& e) {
+            report(std::string("Math error: ") + e.what());
+            return;
+        }
+        if (!(std::fabs(value) < 0x1.0p63)) {
+            report("Math error: 'seed' needs a finite number");
+            return;
+        }
+        rng.seed(static_cast<std::uint64_t>(static_cast<std::int64_t>(value)));
+    }
+
+    // random array min max count fills the array with count draws,
+    // reusing its storage when it already is one
+    void random_fill(const Instruction& ins) {
+        double count;
+        try {
+            count = evaluate_math_expression(ins.c);
+        } catch (const std::exception& e) {
+            report(std::string("Math error: ") + e.what());
+            return;
+        }
+        if (!(count >= 0 && count < 0x1.0p32)) {
+            report("Math error: 'random' count must be between 0 and 2^32");
+            return;
+        }
+        Value& array = slot(ins.a);
+        Elements& items = array.is_array() ? array.elements() : array.make_array();
+        double min_val = program->numbers[ins.b], max_val = program->numbers[ins.b + 1];
+        items.resize(static_cast<size_t>(count));
+        for (Value& item : items) item.set_number(rng.between(min_val, max_val));
+    }
+
+    // array name items...; the items are built aside, as they may read the
+    // array they replace
+    void build_array(const Instruction& ins) {
+        Value array;
+        Elements& items = array.make_array();
+        items.resize(ins.c);
+        for (std::uint32_t i = 0; i < ins.c; ++i) assign(items[i], program->call_args[ins.b + i]);
+        slot(ins.a) = std::move(array);
+    }
+
+    // push name value
+    void push(const Instruction& ins) {
+        Value item;
+        assign(item, ins.b);
+        if (Elements* items = array_operand(ins.a, true)) items->push_back(std::move(item));
+    }
+
+    // put dict key value
+    void put(const Instruction& ins) {
+        KiwiDict* dict = dict_operand(ins.a, true);
+        if (!dict) return;
+        Value value;
+        assign(value, ins.c);
+        ArenaScope scope(arena);
+        KiwiArenaString key{KiwiArenaAllocator<char>(&arena)};
+        render(ins.b, key);
+        (*dict)[key] = std::move(value);
+    }
+
+    // get var dict key copies the value, or unsets var when key is
+    // missing; has var dict key stores 1 or 0
+    void lookup(const Instruction& ins) {
+        const KiwiDict* dict = dict_operand(ins.b, false);
+        if (!dict) return;
+        const Value* value;
+        {
+            ArenaScope scope(arena);
+            KiwiArenaString key{KiwiArenaAllocator<char>(&arena)};
+            render(ins.c, key);
+            value = dict->find(key);
+        }
+        Value& dst = target(ins.a);
+        if (ins.op == OpCode::Has) dst = value ? 1.0 : 0.0;
+        else if (value) dst = *value;
+        else dst.clear();
+    }
+
+    // delete dict key; a missing key is not an error
+    void remove(const Instruction& ins) {
+        KiwiDict* dict = dict_operand(ins.a, false);
+        if (!dict) return;
+        ArenaScope scope(arena);
+        KiwiArenaString key{KiwiArenaAllocator<char>(&arena)};
+        render(ins.b, key);
+        dict->erase(key);
+    }
+
+    // keys var dict stores the keys as an array in insertion order
+    void keys(const Instruction& ins) {
+        const KiwiDict* dict = dict_operand(ins.b, false);
+        if (!dict) return;
+        Value keys;
+        Elements& items = keys.make_array();
+        items.reserve(dict->size());
+        for (const KiwiDict::Entry& entry : dict->entries()) {
+            if (!entry.removed) items.emplace_back(std::string_view(entry.key));
+        }
+        target(ins.a) = std::move(keys);
+    }
+
+    // Sort order: numbers (NaN last), then strings, arrays, dicts and unset values
+    static bool sort_before(const Value& x, const Value& y) {
+        if (x.kind() != y.kind()) {
+            static const int rank[] = {4, 0, 1, 2, 3}; // By Kind: Unset, Number, String, Array, Dict
+            return rank[x.kind()] < rank[y.kind()];
+        }
+        if (x.is_number()) {
+            return std::isnan(y.number()) ? !std::isnan(x.number()) : x.number() < y.number();
+        }
+        return x.is_string() && x.text() < y.text();
+    }
+
+    // Runtime diagnostic, ordered after the output printed so far
+    void report(const std::string& message) {
+        output->flush();
+        errors->write(message);
+        errors->write("\n");
+        errors->flush();
+    }
+
+    // Execute instructions until the End sentinel. Every handler ends by
+    // fetching and dispatching the next instruction itself: through a
+    // switch, or with KIWI_THREADED_DISPATCH through a table of label
+    // addresses (one indirect branch per handler).
+    // A computed goto out of a block skips destructors, so handlers keep
+    // objects that own resources inside the helpers they call.
+    template <bool Profile>
+    void run_loop() {
+        if (exit_requested) return;
+        const Instruction* const code = program->code.data();
+        const Instruction* ins = nullptr;
+        std::chrono::steady_clock::time_point started;
+        size_t depth = 0;
+
+#if KIWI_THREADED_DISPATCH
+        static const void* const handlers[] = {
+            &&op_Set, &&op_Print, &&op_Input, &&op_Call, &&op_Return, &&op_Func, &&op_Main,
+            &&op_EndFunc, &&op_Loop, &&op_EndLoop, &&op_If, &&op_Else, &&op_EndIf, &&op_Break,
+            &&op_Exit, &&op_Math, &&op_Random, &&op_Length, &&op_Clear, &&op_Time, &&op_Timestamp,
+            &&op_Sleep, &&op_For, &&op_EndFor, &&op_While, &&op_EndWhile, &&op_Continue,
+            &&op_Array, &&op_Push, &&op_Sum, &&op_Min, &&op_Max, &&op_Sort,
+            &&op_Dict, &&op_Put, &&op_Get, &&op_Has, &&op_Delete, &&op_Keys,
+            &&op_ForEach, &&op_EndForEach, &&op_Eof, &&op_Open, &&op_Read, &&op_Write, &&op_Close,
+            &&op_Slurp, &&op_Split, &&op_Find, &&op_Substr, &&op_Replace, &&op_Upper, &&op_Lower,
+            &&op_Trim, &&op_Join, &&op_Seed, &&op_RandomFill,
+            &&op_Increment, &&op_Compare, &&op_PrintSlot, &&op_IncrementCompare, &&op_End};
+        static_assert(sizeof(handlers) / sizeof(handlers[0]) == static_cast<size_t>(OpCode::Count),
+                      "handlers out of sync with OpCode");
+#define KIWI_TARGET(name) op_##name
+#define KIWI_JUMP() goto *handlers[static_cast<size_t>(ins->op)]
+#else
+#define KIWI_TARGET(name) case OpCode::name
+#define KIWI_JUMP() goto dispatch
+#endif
+#define KIWI_FETCH()                                        \
+        do {                                                \
+            ins = &code[pc++];                              \
+            if constexpr (Profile) {                        \
+                depth = frames.size();                      \
+                started = std::chrono::steady_clock::now(); \
+            }                                               \
+        } while (0)
+#define KIWI_NEXT()                                                       \
+        do {                                                              \
+            if constexpr (Profile) {                                      \
+                record_profile(*ins, std::chrono::duration_cast<std::chrono::nanoseconds>( \
+                    std::chrono::steady_clock::now() - started).count(), depth); \
+            }                                                             \
+            KIWI_FETCH();                                                 \
+            KIWI_JUMP();                                                  \
+        } while (0)
+
+        KIWI_FETCH();
+        KIWI_JUMP();
+
+#if !KIWI_THREADED_DISPATCH
+    dispatch:
+        switch (ins->op) {
+#endif
+        KIWI_TARGET(Set):
+            assign(target(ins->a), ins->b);
+            KIWI_NEXT();
+        KIWI_TARGET(Print):
+            render(ins->a);
+            line_buffer += '\n';
+            output->write(line_buffer);
+            KIWI_NEXT();
+        KIWI_TARGET(Input):
+            output->flush(); // Make prompts visible
+            if (!read_line(ins->a, *input)) target(ins->a) = std::string_view(); // Empty at end of input
+            KIWI_NEXT();
+        KIWI_TARGET(Call): {
+            const CallSite& site = program->call_sites[ins->a];
+            if (site.function == NO_TARGET) {
+                report("Error: Function '" + program->operands[site.name] + "' not found.");
+                KIWI_NEXT();
+            }
+            // Arguments are evaluated in the caller's frame
+            const Function& fn = program->functions[site.function];
+            std::uint32_t base = static_cast<std::uint32_t>(locals.size());
+            locals.resize(base + fn.locals);
+            for (std::uint32_t i = 0; i < site.args; ++i) {
+                assign(locals[base + i], program->call_args[site.first_arg + i]);
+            }
+            frames.push_back({static_cast<std::uint32_t>(pc), base, site.function, site.result});
+            frame_base = base;
+            pc = fn.entry;
+            KIWI_NEXT();
+        }
+        KIWI_TARGET(Return): {
+            if (frames.empty()) {
+                // Return from the top level ends the script
+                exit_requested = true;
+                output->flush();
+                pc = program->code.size() - 1;
+                KIWI_NEXT();
+            }
+            Value result;
+            if (ins->a != NO_TARGET) assign(result, ins->a);
+            return_from_call(std::move(result));
+            KIWI_NEXT();
+        }
+        KIWI_TARGET(Func):
+            // Definitions are skipped; bodies only run through call
+            pc = ins->target;
+            KIWI_NEXT();
+        KIWI_TARGET(Main):
+            KIWI_NEXT();
+        KIWI_TARGET(EndFunc):
+            if (!frames.empty()) return_from_call(Value());
+            KIWI_NEXT();
+        KIWI_TARGET(Loop):
+            KIWI_NEXT();
+        KIWI_TARGET(EndLoop):
+            pc = ins->target;
+            KIWI_NEXT();
+        KIWI_TARGET(If):
+            if (!evaluate_condition(ins->a)) {
+                pc = ins->target;
+            }
+            KIWI_NEXT();
+        KIWI_TARGET(Else):
+            // Reached from the taken branch
+            pc = ins->target;
+            KIWI_NEXT();
+        KIWI_TARGET(EndIf):
+            KIWI_NEXT();
+        KIWI_TARGET(Break):
+            pc = ins->target;
+            KIWI_NEXT();
+        KIWI_TARGET(Exit):
+            exit_requested = true;
+            output->flush();
+            pc = program->code.size() - 1;
+            KIWI_NEXT();
+        KIWI_TARGET(Math):
+            math(ins->a, ins->b);
+            KIWI_NEXT();
+        KIWI_TARGET(Random):
+            target(ins->a) = rng.between(program->numbers[ins->b], program->numbers[ins->b + 1]);
+            KIWI_NEXT();
+        KIWI_TARGET(Length):
+            target(ins->a) = length(ins->b);
+            KIWI_NEXT();
+        KIWI_TARGET(Clear):
+            output->write("\033[2J\033[1;1H"); // ANSI clear screen
+            KIWI_NEXT();
+        KIWI_TARGET(Time): {
+            auto now = std::chrono::system_clock::now();
+            std::time_t now_time = std::chrono::system_clock::to_time_t(now);
+            std::tm local_tm = local_time(now_time);
+            char text[32];
+            size_t length = std::strftime(text, sizeof text, "%Y-%m-%d %H:%M:%S", &local_tm);
+            target(ins->a) = std::string_view(text, length);
+            KIWI_NEXT();
+        }
+        KIWI_TARGET(Timestamp): {
+            auto duration = std::chrono::system_clock::now().time_since_epoch();
+            target(ins->a) = static_cast<double>(
+                std::chrono::duration_cast<std::chrono::seconds>(duration).count());
+            KIWI_NEXT();
+        }
+        KIWI_TARGET(Sleep):
+            output->flush();
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(static_cast<int>(program->numbers[ins->a] * 1000)));
+            KIWI_NEXT();
+        KIWI_TARGET(For):
+            if (!enter_for(program->for_loops[ins->a])) pc = ins->target;
+            KIWI_NEXT();
+        KIWI_TARGET(EndFor):
+            if (next_for(program->for_loops[ins->a])) pc = ins->target;
+            KIWI_NEXT();
+        KIWI_TARGET(While):
+            if (!(ins->c ? compare(ins->a) : evaluate_condition(ins->a))) pc = ins->target;
+            KIWI_NEXT();
+        KIWI_TARGET(EndWhile):
+            // Test again here so each further pass costs one dispatch
+            if (ins->c ? compare(ins->a) : evaluate_condition(ins->a)) pc = ins->target;
+            KIWI_NEXT();
+        KIWI_TARGET(Continue):
+            pc = ins->target;
+            KIWI_NEXT();
+        KIWI_TARGET(Array):
+            build_array(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Push):
+            push(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Sum):
+        KIWI_TARGET(Min):
+        KIWI_TARGET(Max):
+            reduce(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Sort):
+            if (Elements* items = array_operand(ins->a, false)) {
+                std::sort(items->begin(), items->end(), sort_before);
+            }
+            KIWI_NEXT();
+        KIWI_TARGET(Dict):
+            slot(ins->a).make_dict();
+            KIWI_NEXT();
+        KIWI_TARGET(Put):
+            put(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Get):
+        KIWI_TARGET(Has):
+            lookup(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Delete):
+            remove(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Keys):
+            keys(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(ForEach): {
+            KiwiInput* source = line_source(ins->b);
+            if (!source || !read_line(ins->a, *source)) pc = ins->target;
+            KIWI_NEXT();
+        }
+        KIWI_TARGET(EndForEach): {
+            KiwiInput* source = line_source(ins->b);
+            if (source && read_line(ins->a, *source)) pc = ins->target;
+            KIWI_NEXT();
+        }
+        KIWI_TARGET(Eof):
+            if (KiwiInput* source = line_source(ins->b)) {
+                if (source == input.get()) output->flush(); // Deciding may wait for the user
+                target(ins->a) = source->at_end() ? 1.0 : 0.0;
+            }
+            KIWI_NEXT();
+        KIWI_TARGET(Open):
+            open_file(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Read):
+            if (KiwiInput* source = line_source(ins->b)) {
+                if (!read_line(ins->a, *source)) target(ins->a) = std::string_view(); // Empty at end of file
+            }
+            KIWI_NEXT();
+        KIWI_TARGET(Write):
+            write_file(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Close):
+            if (File* file = file_operand(ins->a)) {
+                if (file->writer) finish_writes(*file, true);
+                *file = File();
+            }
+            KIWI_NEXT();
+        KIWI_TARGET(Slurp):
+            slurp(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Split):
+            split(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Find):
+            find(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Substr):
+            substr(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Replace):
+            replace(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Upper):
+        KIWI_TARGET(Lower):
+            change_case(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Trim):
+            trim(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Join):
+            join(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Seed):
+            seed_from(ins->a);
+            KIWI_NEXT();
+        KIWI_TARGET(RandomFill):
+            random_fill(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Increment):
+            increment(*ins);
+            KIWI_NEXT();
+        KIWI_TARGET(Compare):
+            if (!compare(ins->a)) pc = ins->target;
+            KIWI_NEXT();
+        KIWI_TARGET(PrintSlot):
+            line_buffer.clear();
+            if (ins->a != NO_TARGET) line_buffer += program->operands[ins->a];
+            append_value(line_buffer, slot(ins->b));
+            if (ins->c != NO_TARGET) line_buffer += program->operands[ins->c];
+            line_buffer += '\n';
+            output->write(line_buffer);
+            KIWI_NEXT();
+        KIWI_TARGET(IncrementCompare): {
+            increment(*ins);
+            // Profiled runs take the Compare on its own so it keeps its line
+            if constexpr (!Profile) {
+                const Instruction& next = code[pc++];
+                if (!compare(next.a)) pc = next.target;
+            }
+            KIWI_NEXT();
+        }
+        KIWI_TARGET(End):
+            pc--; // Stay on the sentinel so further runs end at once
+            return;
+#if !KIWI_THREADED_DISPATCH
+        case OpCode::Count:
+            return;
+        }
+#endif
+#undef KIWI_TARGET
+#undef KIWI_JUMP
+#undef KIWI_FETCH
+#undef KIWI_NEXT
+    }
+};
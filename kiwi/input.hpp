@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "platform.hpp"
+
+#if KIWI_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Source of the lines read by the input command and foreach loops
+class KiwiInput {
+public:
+    virtual ~KiwiInput() = default;
+
+    // Next line without its '\n'; false at end of input. The view stays
+    // valid until the next call to either member.
+    virtual bool next_line(std::string_view& line) = 0;
+
+    // True when no lines are left; may wait for more input to arrive
+    virtual bool at_end() = 0;
+};
+
+// Splits a byte stream into lines. Bytes arrive in large chunks and lines
+// are handed out as views into the chunk buffer; only a line cut by the
+// end of a chunk is moved, and the buffer grows to fit longer lines.
+class KiwiChunkedInput : public KiwiInput {
+public:
+    explicit KiwiChunkedInput(size_t chunk_size = 64 * 1024) : chunk_size(std::max<size_t>(chunk_size, 1)) {}
+
+    bool next_line(std::string_view& line) override {
+        for (;;) {
+            const void* nl = scan < end ? std::memchr(buffer.data() + scan, '\n', end - scan) : nullptr;
+            if (nl) {
+                size_t stop = static_cast<const char*>(nl) - buffer.data();
+                line = std::string_view(buffer.data() + start, stop - start);
+                start = scan = stop + 1;
+                return true;
+            }
+            scan = end;
+            if (!refill()) {
+                if (start == end) return false;
+                line = std::string_view(buffer.data() + start, end - start); // Last line without '\n'
+                start = scan = end;
+                return true;
+            }
+        }
+    }
+
+    bool at_end() override { return start == end && !refill(); }
+
+protected:
+    // Read up to size bytes into dst, waiting for at least one; 0 at end
+    // of input
+    virtual size_t fill(char* dst, size_t size) = 0;
+
+private:
+    std::vector<char> buffer; // Allocated by the first refill
+    size_t chunk_size;
+    size_t start = 0;    // First byte not handed out
+    size_t scan = 0;     // First byte not yet searched for '\n'
+    size_t end = 0;      // End of valid bytes
+    bool eof = false;
+
+    // Read another chunk behind the pending bytes; false at end of input
+    bool refill() {
+        if (eof) return false;
+        if (start > 0) {
+            std::memmove(buffer.data(), buffer.data() + start, end - start);
+            scan -= start;
+            end -= start;
+            start = 0;
+        }
+        if (buffer.empty()) buffer.resize(chunk_size);
+        else if (end == buffer.size()) buffer.resize(buffer.size() * 2);
+        size_t n = fill(buffer.data() + end, buffer.size() - end);
+        if (n == 0) {
+            eof = true;
+            return false;
+        }
+        end += n;
+        return true;
+    }
+};
+
+#if KIWI_POSIX
+// Chunked reader on a file descriptor; stdin by default
+class KiwiFdInput : public KiwiChunkedInput {
+public:
+    explicit KiwiFdInput(int fd = STDIN_FILENO, bool owned = false, size_t chunk_size = 64 * 1024)
+        : KiwiChunkedInput(chunk_size), fd(fd), owned(owned) {}
+
+    // Open path for reading; throws std::runtime_error when it cannot be read
+    static std::shared_ptr<KiwiFdInput> open(const std::string& path, size_t chunk_size = 64 * 1024) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error("Cannot read '" + path + "': " + std::strerror(errno));
+        return std::make_shared<KiwiFdInput>(fd, true, chunk_size);
+    }
+
+    KiwiFdInput(const KiwiFdInput&) = delete;
+    KiwiFdInput& operator=(const KiwiFdInput&) = delete;
+
+    ~KiwiFdInput() override {
+        if (owned) ::close(fd);
+    }
+
+protected:
+    size_t fill(char* dst, size_t size) override {
+        for (;;) {
+            ssize_t n = ::read(fd, dst, size);
+            if (n >= 0) return static_cast<size_t>(n);
+            if (errno != EINTR) return 0; // Read errors end the input
+        }
+    }
+
+private:
+    int fd;
+    bool owned;
+};
+#endif
+
+// Input pushed by the host from its own buffers, possibly from another
+// thread while the script runs. Reads wait for more bytes until close().
+class KiwiBufferInput : public KiwiChunkedInput {
+public:
+    using KiwiChunkedInput::KiwiChunkedInput;
+
+    // Queue bytes; lines may span pushes
+    void push(std::string_view bytes) {
+        if (bytes.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.emplace_back(bytes);
+        }
+        ready.notify_one();
+    }
+
+    // Mark the end of input once the queued bytes are read
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        ready.notify_one();
+    }
+
+protected:
+    size_t fill(char* dst, size_t size) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&] { return !pending.empty() || closed; });
+        if (pending.empty()) return 0;
+        const std::string& front = pending.front();
+        size_t n = std::min(size, front.size() - offset);
+        std::memcpy(dst, front.data() + offset, n);
+        offset += n;
+        if (offset == front.size()) {
+            pending.pop_front();
+            offset = 0;
+        }
+        return n;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::string> pending; // Pushed blocks not yet read
+    size_t offset = 0;               // Bytes of the front block already read
+    bool closed = false;
+};
+
+// Lines from a std::istream: std::cin by default, a stream the host
+// already holds, or a file opened by open()
+class KiwiStreamInput : public KiwiInput {
+public:
+    explicit KiwiStreamInput(std::istream& in = std::cin) : in(&in) {}
+
+    // Open path for reading; throws std::runtime_error when it cannot be read
+    static std::shared_ptr<KiwiStreamInput> open(const std::string& path) {
+        auto file = std::make_unique<std::ifstream>(path, std::ios::binary);
+        if (!*file) throw std::runtime_error("Cannot read '" + path + "'");
+        auto input = std::make_shared<KiwiStreamInput>(*file);
+        input->owned = std::move(file);
+        return input;
+    }
+
+    bool next_line(std::string_view& line) override {
+        if (!std::getline(*in, buffer)) return false;
+        line = buffer;
+        return true;
+    }
+
+    bool at_end() override { return in->peek() == std::char_traits<char>::eof(); }
+
+private:
+    std::unique_ptr<std::istream> owned; // File opened by open()
+    std::istream* in;
+    std::string buffer;
+};
+
+// Lines supplied up front by embedders, tests and batch jobs
+class KiwiLinesInput : public KiwiInput {
+public:
+    KiwiLinesInput() = default;
+    explicit KiwiLinesInput(std::vector<std::string> lines) : lines(std::move(lines)) {}
+
+    // Replace the remaining lines
+    void assign(std::vector<std::string> next) {
+        lines = std::move(next);
+        pos = 0;
+    }
+
+    bool next_line(std::string_view& line) override {
+        if (pos >= lines.size()) return false;
+        line = lines[pos++];
+        return true;
+    }
+
+    bool at_end() override { return pos >= lines.size(); }
+
+private:
+    std::vector<std::string> lines;
+    size_t pos = 0;
+};
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "platform.hpp"
+
+#if KIWI_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Destination for everything a script prints
+class KiwiOutput {
+public:
+    virtual ~KiwiOutput() = default;
+
+    // Append text; sinks may buffer it until flush()
+    virtual void write(std::string_view text) = 0;
+
+    // Push buffered text to its destination
+    virtual void flush() {}
+
+    // Flush and release the destination; later writes are dropped
+    virtual void close() { flush(); }
+
+    // errno value of the first write that failed since the last call, or 0
+    virtual int take_error() { return 0; }
+};
+
+// Buffered writer on a std::ostream; std::cout by default. Text reaches
+// the stream in large blocks, in order with whatever the host writes to
+// the same stream.
+class KiwiStreamOutput : public KiwiOutput {
+public:
+    explicit KiwiStreamOutput(std::ostream& out = std::cout, size_t capacity = 64 * 1024)
+        : out(&out), capacity(capacity) {}
+
+    // Create or truncate path, or append to it; throws std::runtime_error
+    // when it cannot be opened
+    static std::shared_ptr<KiwiStreamOutput> open(const std::string& path, bool append = false,
+                                                  size_t capacity = 64 * 1024) {
+        auto file = std::make_unique<std::ofstream>(
+            path, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+        if (!*file) throw std::runtime_error("Cannot write '" + path + "'");
+        auto output = std::make_shared<KiwiStreamOutput>(*file, capacity);
+        output->owned = std::move(file);
+        return output;
+    }
+
+    KiwiStreamOutput(const KiwiStreamOutput&) = delete;
+    KiwiStreamOutput& operator=(const KiwiStreamOutput&) = delete;
+
+    ~KiwiStreamOutput() override { flush(); }
+
+    void write(std::string_view text) override {
+        if (closed) return;
+        if (buffer.size() + text.size() > capacity) {
+            flush();
+            if (text.size() >= capacity) {
+                out->write(text.data(), static_cast<std::streamsize>(text.size()));
+                return;
+            }
+        }
+        if (buffer.capacity() < capacity) buffer.reserve(capacity); // On first use
+        buffer.append(text.data(), text.size());
+    }
+
+    void flush() override {
+        if (closed) return;
+        if (!buffer.empty()) out->write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+        out->flush();
+    }
+
+    void close() override {
+        flush();
+        if (owned) owned->close();
+        closed = true;
+    }
+
+    // Streams do not say why they failed, so any failure is an I/O error
+    int take_error() override {
+        if (!out->fail() || failed) return 0;
+        failed = true;
+        return EIO;
+    }
+
+private:
+    std::unique_ptr<std::ofstream> owned; // File opened by open()
+    std::ostream* out;
+    size_t capacity;
+    std::string buffer;
+    bool closed = false;
+    bool failed = false; // Failure already taken
+};
+
+#if KIWI_POSIX
+// Buffered writer on a file descriptor; stdout by default
+class KiwiFdOutput : public KiwiOutput {
+public:
+    explicit KiwiFdOutput(int fd = STDOUT_FILENO, size_t capacity = 64 * 1024, bool owned = false)
+        : fd(fd), capacity(capacity), owned(owned) {}
+
+    // Create or truncate path, or append to it; throws std::runtime_error
+    // when it cannot be opened
+    static std::shared_ptr<KiwiFdOutput> open(const std::string& path, bool append = false,
+                                              size_t capacity = 64 * 1024) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+        int fd = ::open(path.c_str(), flags, 0644);
+        if (fd < 0) throw std::runtime_error("Cannot write '" + path + "': " + std::strerror(errno));
+        return std::make_shared<KiwiFdOutput>(fd, capacity, true);
+    }
+
+    KiwiFdOutput(const KiwiFdOutput&) = delete;
+    KiwiFdOutput& operator=(const KiwiFdOutput&) = delete;
+
+    ~KiwiFdOutput() override {
+        if (owned) close();
+        else flush();
+    }
+
+    void write(std::string_view text) override {
+        if (fd < 0) return;
+        if (buffer.size() + text.size() > capacity) {
+            flush();
+            if (text.size() >= capacity) {
+                write_all(text.data(), text.size());
+                return;
+            }
+        }
+        if (buffer.capacity() < capacity) buffer.reserve(capacity); // On first use
+        buffer.append(text.data(), text.size());
+    }
+
+    void flush() override {
+        write_all(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    // Closes the descriptor too when this sink owns it
+    void close() override {
+        if (fd < 0) return;
+        flush();
+        if (owned && ::close(fd) != 0 && !error) error = errno;
+        fd = -1;
+    }
+
+    int take_error() override {
+        int taken = error;
+        error = 0;
+        return taken;
+    }
+
+private:
+    int fd;          // -1 once closed
+    size_t capacity;
+    bool owned;
+    int error = 0;   // First failure not yet taken
+    std::string buffer;
+
+    // Write everything, or note the failure and drop the rest
+    void write_all(const char* data, size_t size) {
+        while (size > 0 && fd >= 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (!error) error = errno;
+                return;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+};
+#endif
+
+// Collects output in memory for embedders and tests
+class KiwiStringOutput : public KiwiOutput {
+public:
+    void write(std::string_view text) override { text_.append(text.data(), text.size()); }
+
+    const std::string& str() const { return text_; }
+    void clear() { text_.clear(); }
+
+private:
+    std::string text_;
+};
+
+// Hands every write to a user callback
+class KiwiCallbackOutput : public KiwiOutput {
+public:
+    using Callback = std::function<void(std::string_view)>;
+
+    explicit KiwiCallbackOutput(Callback on_write, std::function<void()> on_flush = nullptr)
+        : on_write(std::move(on_write)), on_flush(std::move(on_flush)) {}
+
+    void write(std::string_view text) override { on_write(text); }
+
+    void flush() override {
+        if (on_flush) on_flush();
+    }
+
+private:
+    Callback on_write;
+    std::function<void()> on_flush;
+};
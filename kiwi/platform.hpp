@@ -0,0 +1,13 @@
+#pragma once
+
+// KIWI_POSIX is 1 where the POSIX file API (open, read, write, mmap) is
+// available. The descriptor-based input and output classes and the
+// read-only file mapping need it; elsewhere files go through the
+// standard streams. Define it to 0 to build the portable paths anyway.
+#ifndef KIWI_POSIX
+#if defined(__unix__) || defined(__APPLE__)
+#define KIWI_POSIX 1
+#else
+#define KIWI_POSIX 0
+#endif
+#endif
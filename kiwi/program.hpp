@@ -0,0 +1,1408 @@
+#pragma once
+
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <stdexcept>
+#include <cctype>
+#include <cerrno>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "source.hpp"
+
+// Compiled form of a script. A program is immutable once constructed, so
+// one instance can be shared by any number of KiwiContexts, each running
+// it on its own thread.
+class KiwiProgram {
+public:
+    // Decoded command of a compiled line
+    enum class OpCode : std::uint8_t {
+        Set, Print, Input, Call, Return, Func, Main, EndFunc, Loop, EndLoop,
+        If, Else, EndIf, Break, Exit, Math, Random, Length,
+        Clear, Time, Timestamp, Sleep, For, EndFor, While, EndWhile, Continue,
+        Array, Push, Sum, Min, Max, Sort, Dict, Put, Get, Has, Delete, Keys,
+        ForEach, EndForEach, Eof, Open, Read, Write, Close, Slurp,
+        Split, Find, Substr, Replace, Upper, Lower, Trim, Join, Seed,
+        RandomFill,       // random into an array
+        Increment,        // math x = x + k on a number
+        Compare,          // if on a variable against a number
+        PrintSlot,        // print of one variable between literals
+        IncrementCompare, // Increment then the Compare that follows it
+        End,  // Sentinel after the last instruction
+        Count // Number of opcodes
+    };
+
+    static constexpr std::uint32_t NO_TARGET = UINT32_MAX;
+    static constexpr std::uint32_t DYNAMIC_NAME = 0x80000000u; // Target name is a template
+    static constexpr std::uint32_t LOCAL_SLOT = 0x40000000u;   // Slot lives in the current frame
+    static constexpr std::uint32_t ELEMENT_REF = 0x20000000u;  // Target is an array element
+
+    // How open accesses its file
+    enum FileMode : std::uint32_t { ReadFile, WriteFile, AppendFile };
+
+    // Pre-parsed instruction; operands index into the constant pools
+    struct Instruction {
+        OpCode op;
+        std::uint32_t line;              // Source line for diagnostics
+        std::uint32_t a = 0;             // First operand
+        std::uint32_t b = 0;             // Second operand
+        std::uint32_t c = 0;             // Third operand
+        std::uint32_t target = NO_TARGET; // Resolved jump target
+    };
+
+    // Piece of a compiled interpolation template
+    struct Piece {
+        enum Kind : std::uint8_t { Literal, Variable, DynamicVariable, Expression, Element };
+        Kind kind;
+        std::uint32_t index;        // Literal operand, slot, name template, expression or element
+        std::uint32_t fallback = 0; // Literal operand emitted when an expression fails
+    };
+
+    // Contiguous run of pieces in the piece pool
+    struct Template {
+        std::uint32_t first;
+        std::uint32_t count;
+        std::uint32_t literal_size; // Bytes contributed by literal pieces
+    };
+
+    // Postfix math operation
+    struct MathOp {
+        enum Kind : std::uint8_t { Const, Load, LoadDynamic, LoadElement, Add, Sub, Mul, Div, Pow, Neg };
+        Kind kind;
+        std::uint32_t index = 0; // Slot or name template for loads; LoadElement pops its index
+        double value = 0;        // Constant operand
+    };
+
+    // Compiled math expression: a contiguous run of postfix operations
+    struct Expression {
+        std::uint32_t first;
+        std::uint32_t count;
+        std::uint32_t depth; // Evaluation stack depth needed
+    };
+
+    // Operand of a compiled condition
+    struct CondOperand {
+        enum Kind : std::uint8_t { Literal, Variable, Template };
+        Kind kind;
+        std::uint32_t index;                 // Literal operand, slot or template
+        std::uint32_t fallback = NO_TARGET;  // Literal operand used while a bare name is unset
+        bool numeric = false;                // Literal parses as a number
+        double number = 0;                   // Its value
+    };
+
+    // Compiled condition; Truth tests a single operand
+    struct Condition {
+        enum Compare : std::uint8_t { Truth, Eq, Ne, Lt, Gt, Le, Ge };
+        Compare op;
+        CondOperand lhs;
+        CondOperand rhs;
+    };
+
+    // Array element a[i]: the array's slot and the index expression
+    struct Element {
+        std::uint32_t array;
+        std::uint32_t index;
+    };
+
+    // Function definition resolved at load time
+    struct Function {
+        std::uint32_t name;        // Name operand
+        std::uint32_t entry;       // First body instruction
+        std::uint32_t first_local; // First entry in local_names
+        std::uint32_t params;      // Parameter count; parameters are the first locals
+        std::uint32_t locals;      // Frame size
+    };
+
+    // Compiled call: callee, argument templates and result target
+    struct CallSite {
+        std::uint32_t name;              // Callee name operand
+        std::uint32_t function;          // Callee, NO_TARGET when undefined
+        std::uint32_t first_arg;         // First template in call_args
+        std::uint32_t args;              // Argument count
+        std::uint32_t result = NO_TARGET; // Target receiving the return value
+    };
+
+    // Counted loop: counter runs from start towards limit by step. Limit
+    // and step are evaluated once on entry and kept in hidden slots. A
+    // for-in loop instead copies each element of an array, or each key of
+    // a dict, into counter.
+    struct ForLoop {
+        std::uint32_t counter;           // Counter target
+        std::uint32_t start;             // Start expression
+        std::uint32_t limit;             // Limit expression
+        std::uint32_t step = NO_TARGET;  // Step expression, NO_TARGET for 1
+        std::uint32_t limit_slot;        // Hidden slot holding the limit
+        std::uint32_t step_slot;         // Hidden slot holding the step
+        std::uint32_t array = NO_TARGET; // Array or dict slot of a for-in loop; limit_slot holds the position
+    };
+
+    // Empty program; runs to completion immediately
+    KiwiProgram() : source(std::make_shared<const KiwiSource>(std::string())) {
+        compile();
+    }
+
+    // Compile script text; throws std::runtime_error on unbalanced blocks
+    explicit KiwiProgram(std::shared_ptr<const KiwiSource> text) : source(std::move(text)) {
+        compile();
+    }
+
+    explicit KiwiProgram(const std::vector<std::string>& lines) : KiwiProgram(KiwiSource::from_lines(lines)) {}
+
+    // Compile a script file straight from its read-only mapping
+    static std::shared_ptr<const KiwiProgram> load_file(const std::string& path) {
+        return std::make_shared<const KiwiProgram>(KiwiSource::from_file(path));
+    }
+
+    KiwiProgram(const KiwiProgram&) = delete;
+    KiwiProgram& operator=(const KiwiProgram&) = delete;
+
+    const std::vector<std::string_view>& lines() const { return source->lines(); }
+
+    // Problems found while compiling lines that were then skipped; a
+    // context reports them on its first run
+    const std::vector<std::string>& diagnostics() const { return warnings; }
+
+    // Trim whitespace from string
+    static std::string_view trim(std::string_view s) {
+        auto start = s.find_first_not_of(" \t\r");
+        if (start == std::string_view::npos) return {};
+        auto end = s.find_last_not_of(" \t\r");
+        return s.substr(start, end - start + 1);
+    }
+
+    // Split off the first whitespace-delimited word
+    static std::string_view next_word(std::string_view& s) {
+        s = trim(s);
+        size_t end = s.find_first_of(" \t");
+        std::string_view word = s.substr(0, end);
+        s = end == std::string_view::npos ? std::string_view() : trim(s.substr(end));
+        return word;
+    }
+
+    // Try parsing number from string. Floating-point from_chars and
+    // to_chars are missing from older standard libraries (libc++ before
+    // LLVM 20, libstdc++ before GCC 11); there strtod and snprintf stand in.
+    static bool try_parse_number(std::string_view s, double& num) {
+        if (s.empty()) return false;
+#if defined(__cpp_lib_to_chars)
+        auto result = std::from_chars(s.data(), s.data() + s.size(), num);
+        return result.ec == std::errc() && result.ptr == s.data() + s.size();
+#else
+        // strtod also takes leading space, '+' and hex; from_chars does not
+        size_t digits = s[0] == '-' ? 1 : 0;
+        if (digits == s.size() || isspace(static_cast<unsigned char>(s[digits])) || s[digits] == '+' ||
+            (s[digits] == '0' && digits + 1 < s.size() && (s[digits + 1] == 'x' || s[digits + 1] == 'X'))) {
+            return false;
+        }
+        std::string text(s);
+        char* end = nullptr;
+        errno = 0;
+        num = std::strtod(text.c_str(), &end);
+        // ERANGE also flags subnormal results, which from_chars accepts
+        bool in_range = errno != ERANGE || (num != 0 && std::isfinite(num));
+        return in_range && end == text.c_str() + text.size();
+#endif
+    }
+
+    // Append shortest round-trip decimal form of a number
+    template <typename Out>
+    static void append_number(Out& out, double value) {
+        char buf[400];
+#if defined(__cpp_lib_to_chars)
+        auto result = std::to_chars(buf, buf + sizeof buf, value, std::chars_format::fixed);
+        out.append(buf, result.ptr - buf);
+#else
+        int precision = 0;
+        if (std::isfinite(value)) {
+            // Fewest significant digits that read back as value, then as
+            // many decimals as those digits reach past the point
+            int digits = 0;
+            while (digits < 17) {
+                std::snprintf(buf, sizeof buf, "%.*e", digits, value);
+                if (std::strtod(buf, nullptr) == value) break;
+                digits++;
+            }
+            precision = std::max(0, digits - std::atoi(std::strchr(buf, 'e') + 1));
+        }
+        int length = std::snprintf(buf, sizeof buf, "%.*f", precision, value);
+        out.append(buf, static_cast<size_t>(length));
+#endif
+    }
+
+    // Parse a number only when printing it gives back the same text, so a
+    // stored value keeps its spelling: 02134, 1.50 and Infinity stay text
+    static bool try_parse_exact_number(std::string_view s, double& num) {
+        // Printed numbers look like -?(0|[1-9][0-9]*)(.[0-9]*[1-9])?
+        size_t i = !s.empty() && s[0] == '-' ? 1 : 0;
+        size_t start = i;
+        while (i < s.size() && isdigit(static_cast<unsigned char>(s[i]))) i++;
+        size_t digits = i - start;
+        if (digits == 0 || (s[start] == '0' && digits > 1)) return false;
+        if (i < s.size()) {
+            if (s[i] != '.' || i + 1 == s.size() || s.back() == '0') return false;
+            for (size_t j = i + 1; j < s.size(); ++j) {
+                if (!isdigit(static_cast<unsigned char>(s[j]))) return false;
+            }
+            digits += s.size() - i - 1;
+        }
+        if (!try_parse_number(s, num)) return false;
+        // Up to 15 digits survive the trip through a double unchanged
+        if (digits <= 15) return true;
+        struct Spelling {
+            std::string_view text;
+            bool same = false;
+            void append(const char* data, size_t size) { same = text == std::string_view(data, size); }
+        } spelling{s};
+        append_number(spelling, num);
+        return spelling.same;
+    }
+
+    // Text of a stored string, honouring the NULL and \sp escapes
+    static std::string_view value_text(std::string_view s) {
+        if (s == "NULL") return {};
+        if (s == "\\sp") return " ";
+        return s;
+    }
+
+    // Command keyword of an opcode for diagnostics and profiles
+    static const char* op_name(OpCode op) {
+        static const char* const op_names[] = {
+            "set", "print", "input", "call", "return", "func", "main", "endfunc", "loop", "endloop",
+            "if", "else", "endif", "break", "exit", "math", "random", "length",
+            "clear", "time", "timestamp", "sleep", "for", "endfor", "while", "endwhile", "continue",
+            "array", "push", "sum", "min", "max", "sort", "dict", "put", "get", "has", "delete", "keys",
+            "foreach", "endforeach", "eof", "open", "read", "write", "close", "slurp",
+            "split", "find", "substr", "replace", "upper", "lower", "trim", "join", "seed", "random (fill)",
+            "math (increment)", "if (compare)", "print (slot)", "math+if", "end"};
+        static_assert(sizeof(op_names) / sizeof(op_names[0]) == static_cast<size_t>(OpCode::Count),
+                      "op_names out of sync with OpCode");
+        return op_names[static_cast<size_t>(op)];
+    }
+
+private:
+    friend class KiwiContext;
+    friend class KiwiBytecode;
+
+    // Source whose compiled form is filled in from a bytecode image
+    struct Precompiled {};
+    KiwiProgram(std::shared_ptr<const KiwiSource> text, Precompiled) : source(std::move(text)) {}
+
+    std::shared_ptr<const KiwiSource> source;          // Script text and its lines
+    std::vector<Instruction> code;                     // Instruction stream
+    std::vector<std::string> operands;                 // String operand pool
+    std::vector<double> numbers;                       // Numeric operand pool
+    std::map<std::string, size_t> function_locations;  // Function name -> function index
+    std::vector<Function> functions;                   // Function table
+    std::vector<std::string> local_names;              // Parameter and local names
+    std::vector<CallSite> call_sites;                  // Compiled calls
+    std::vector<std::uint32_t> call_args;              // Call argument, array item and string command operands
+    std::vector<std::string> names;                    // Interned variable names
+    std::unordered_map<std::string, std::uint32_t> name_slots; // Name -> slot while compiling
+    std::unordered_map<std::string_view, std::uint32_t> name_index; // Name -> slot, keys into names
+    std::vector<Piece> pieces;                         // Template piece pool
+    std::vector<Template> templates;                   // Compiled print/set/... arguments
+    std::vector<MathOp> math_ops;                      // Postfix operation pool
+    std::vector<Expression> expressions;               // Compiled math expressions
+    size_t math_depth = 0;                             // Deepest expression stack
+    std::vector<Condition> conditions;                 // Compiled if conditions
+    std::vector<ForLoop> for_loops;                    // Compiled for headers
+    std::vector<Element> elements;                     // Array element references
+    std::vector<std::string> warnings;                 // Load-time diagnostics
+    std::uint32_t current_function = NO_TARGET;        // Function being compiled
+    std::unordered_map<std::string, std::uint32_t> local_scope; // Its locals by name
+
+    // Record "problem at line n[: detail]" for the line being compiled
+    void warn(std::uint32_t line_no, const char* problem, const char* detail = nullptr) {
+        std::string message = std::string(problem) + " at line " + std::to_string(line_no + 1);
+        if (detail) message += std::string(": ") + detail;
+        warnings.push_back(std::move(message));
+    }
+
+    // Record "Invalid 'cmd' syntax" for a malformed line, which is skipped
+    bool invalid_syntax(std::uint32_t line_no, std::string_view cmd) {
+        warn(line_no, ("Invalid '" + std::string(cmd) + "' syntax").c_str());
+        return false;
+    }
+
+    std::uint32_t add_operand(std::string_view text) {
+        operands.emplace_back(text);
+        return static_cast<std::uint32_t>(operands.size() - 1);
+    }
+
+    // Slot of a variable name, allocated on first sight; parameters and
+    // locals of the function being compiled shadow globals
+    std::uint32_t intern(std::string_view name) {
+        if (current_function != NO_TARGET) {
+            auto local = local_scope.find(std::string(name));
+            if (local != local_scope.end()) return local->second | LOCAL_SLOT;
+        }
+        auto inserted = name_slots.emplace(std::string(name), static_cast<std::uint32_t>(names.size()));
+        if (inserted.second) names.emplace_back(name);
+        return inserted.first->second;
+    }
+
+    // Intern an assignment target; names built with {{}} stay dynamic
+    std::uint32_t add_name(std::string_view name) {
+        std::uint32_t element = add_element(name);
+        if (element != NO_TARGET) return element | ELEMENT_REF;
+        if (name.find("{{") != std::string_view::npos) {
+            return compile_template(name) | DYNAMIC_NAME;
+        }
+        return intern(name);
+    }
+
+    // End of the {{...}} placeholder opened at pos, honouring nesting
+    static size_t placeholder_end(std::string_view text, size_t pos) {
+        int depth = 0;
+        for (size_t i = pos; i + 1 < text.size();) {
+            if (text[i] == '{' && text[i + 1] == '{') {
+                depth++;
+                i += 2;
+            } else if (text[i] == '}' && text[i + 1] == '}') {
+                if (--depth == 0) return i;
+                i += 2;
+            } else {
+                i++;
+            }
+        }
+        return std::string_view::npos;
+    }
+
+    // Recursive-descent compiler from infix text to postfix operations
+    class ExpressionCompiler {
+    public:
+        ExpressionCompiler(KiwiProgram& owner, std::string_view text)
+            : owner(owner), text(text) {}
+
+        std::uint32_t compile() {
+            parse_sum();
+            skip_space();
+            if (pos != text.size()) fail("Unexpected '" + std::string(1, text[pos]) + "'");
+            Expression expr{static_cast<std::uint32_t>(owner.math_ops.size()),
+                            static_cast<std::uint32_t>(ops.size()), max_depth};
+            owner.math_ops.insert(owner.math_ops.end(), ops.begin(), ops.end());
+            owner.math_depth = std::max<size_t>(owner.math_depth, max_depth);
+            owner.expressions.push_back(expr);
+            return static_cast<std::uint32_t>(owner.expressions.size() - 1);
+        }
+
+    private:
+        KiwiProgram& owner;
+        std::string_view text;
+        size_t pos = 0;
+        std::vector<MathOp> ops;
+        std::uint32_t depth = 0;
+        std::uint32_t max_depth = 0;
+
+        [[noreturn]] void fail(const std::string& message) {
+            throw std::runtime_error(message + " in '" + std::string(text) + "'");
+        }
+
+        void skip_space() {
+            while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos]))) pos++;
+        }
+
+        bool accept(char c) {
+            skip_space();
+            if (pos < text.size() && text[pos] == c) {
+                pos++;
+                return true;
+            }
+            return false;
+        }
+
+        void push(const MathOp& op) {
+            ops.push_back(op);
+            max_depth = std::max(max_depth, ++depth);
+        }
+
+        // Emit a binary operator, folding it when both operands are constants
+        void binary(MathOp::Kind kind) {
+            depth--;
+            size_t n = ops.size();
+            if (n >= 2 && ops[n - 1].kind == MathOp::Const && ops[n - 2].kind == MathOp::Const &&
+                !(kind == MathOp::Div && ops[n - 1].value == 0)) {
+                double l = ops[n - 2].value, r = ops[n - 1].value;
+                ops.pop_back();
+                switch (kind) {
+                    case MathOp::Add: ops.back().value = l + r; break;
+                    case MathOp::Sub: ops.back().value = l - r; break;
+                    case MathOp::Mul: ops.back().value = l * r; break;
+                    case MathOp::Div: ops.back().value = l / r; break;
+                    default: ops.back().value = std::pow(l, r); break;
+                }
+                return;
+            }
+            ops.push_back({kind});
+        }
+
+        // Emit a negation, folding it into a constant operand
+        void negate() {
+            if (ops.back().kind == MathOp::Const) ops.back().value = -ops.back().value;
+            else ops.push_back({MathOp::Neg});
+        }
+
+        void parse_sum() {
+            parse_product();
+            for (;;) {
+                if (accept('+')) { parse_product(); binary(MathOp::Add); }
+                else if (accept('-')) { parse_product(); binary(MathOp::Sub); }
+                else return;
+            }
+        }
+
+        void parse_product() {
+            parse_unary();
+            for (;;) {
+                if (accept('*')) { parse_unary(); binary(MathOp::Mul); }
+                else if (accept('/')) { parse_unary(); binary(MathOp::Div); }
+                else return;
+            }
+        }
+
+        // A leading sign applies to the whole power: -2^2 is -(2^2)
+        void parse_unary() {
+            if (accept('-')) {
+                parse_unary();
+                negate();
+            }
+            else if (accept('+')) {
+                parse_unary();
+            }
+            else {
+                parse_power();
+            }
+        }
+
+        void parse_power() {
+            parse_primary();
+            while (accept('^')) {
+                parse_exponent();
+                binary(MathOp::Pow);
+            }
+        }
+
+        // A sign right after ^ belongs to the exponent alone: 2^-1 is 0.5
+        void parse_exponent() {
+            if (accept('-')) {
+                parse_exponent();
+                negate();
+            }
+            else if (accept('+')) {
+                parse_exponent();
+            }
+            else {
+                parse_primary();
+            }
+        }
+
+        void parse_primary() {
+            skip_space();
+            if (pos >= text.size()) fail("Unexpected end of expression");
+            char c = text[pos];
+            if (c == '(') {
+                pos++;
+                parse_sum();
+                if (!accept(')')) fail("Unbalanced parentheses");
+            }
+            else if (isdigit(static_cast<unsigned char>(c)) || c == '.') {
+                size_t start = pos;
+                while (pos < text.size() && (isdigit(static_cast<unsigned char>(text[pos])) || text[pos] == '.')) pos++;
+                double value;
+                if (!try_parse_number(text.substr(start, pos - start), value)) {
+                    fail("Invalid number");
+                }
+                push({MathOp::Const, 0, value});
+            }
+            else if (isalpha(static_cast<unsigned char>(c)) || c == '_' || text.compare(pos, 2, "{{") == 0) {
+                // Variable name, possibly built from {{...}} placeholders
+                size_t start = pos;
+                bool dynamic = false;
+                while (pos < text.size()) {
+                    if (isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '_') {
+                        pos++;
+                    } else if (text.compare(pos, 2, "{{") == 0) {
+                        size_t end = placeholder_end(text, pos);
+                        if (end == std::string_view::npos) fail("Unterminated placeholder");
+                        dynamic = true;
+                        pos = end + 2;
+                    } else {
+                        break;
+                    }
+                }
+                std::string_view name = text.substr(start, pos - start);
+                if (name.size() > 4 && name.compare(0, 2, "{{") == 0 &&
+                    placeholder_end(name, 0) == name.size() - 2) {
+                    // A lone {{name}} reads the variable as a number
+                    name = trim(name.substr(2, name.size() - 4));
+                    dynamic = name.find("{{") != std::string_view::npos;
+                }
+                if (dynamic) {
+                    push({MathOp::LoadDynamic, owner.compile_template(name)});
+                } else if (accept('[')) {
+                    // name[index]: the index is computed first and replaced by the element
+                    std::uint32_t array = owner.intern(name);
+                    parse_sum();
+                    if (!accept(']')) fail("Unbalanced brackets");
+                    ops.push_back({MathOp::LoadElement, array});
+                } else {
+                    push({MathOp::Load, owner.intern(name)});
+                }
+            }
+            else {
+                fail("Unexpected '" + std::string(1, c) + "'");
+            }
+        }
+    };
+
+    // Compile infix math text; throws std::runtime_error when malformed
+    std::uint32_t compile_expression(std::string_view text) {
+        return ExpressionCompiler(*this, text).compile();
+    }
+
+    static bool is_identifier(std::string_view text) {
+        if (text.empty() || !(isalpha(static_cast<unsigned char>(text[0])) || text[0] == '_')) return false;
+        return std::all_of(text.begin(), text.end(), [](char c) {
+            return isalnum(static_cast<unsigned char>(c)) || c == '_';
+        });
+    }
+
+    // Split name[index] into the array name and the index text
+    static bool split_element(std::string_view text, std::string_view& name, std::string_view& index) {
+        size_t open = text.find('[');
+        if (open == std::string_view::npos || text.back() != ']') return false;
+        name = trim(text.substr(0, open));
+        index = text.substr(open + 1, text.size() - open - 2);
+        return is_identifier(name);
+    }
+
+    // Element reference for name[index]; NO_TARGET when text is not one
+    std::uint32_t add_element(std::string_view text) {
+        std::string_view name, index;
+        if (!split_element(text, name, index)) return NO_TARGET;
+        std::uint32_t expr;
+        try {
+            expr = compile_expression(index);
+        } catch (const std::runtime_error&) {
+            return NO_TARGET;
+        }
+        elements.push_back({intern(name), expr});
+        return static_cast<std::uint32_t>(elements.size() - 1);
+    }
+
+    // A bare name refers to a variable, falling back to its own text while
+    // unset; a bare a[i] to an element; text with placeholders is rendered;
+    // anything else is a literal
+    CondOperand compile_operand(std::string_view text) {
+        text = trim(text);
+        CondOperand operand{CondOperand::Literal, 0};
+        if (is_identifier(text)) {
+            operand.kind = CondOperand::Variable;
+            operand.index = intern(text);
+            operand.fallback = add_operand(text);
+            return operand;
+        }
+        if (text.size() > 4 && text.compare(0, 2, "{{") == 0 && placeholder_end(text, 0) == text.size() - 2) {
+            std::string_view name = trim(text.substr(2, text.size() - 4));
+            if (is_identifier(name)) {
+                operand.kind = CondOperand::Variable;
+                operand.index = intern(name);
+                return operand;
+            }
+        }
+        std::uint32_t element = add_element(text);
+        if (element != NO_TARGET) {
+            templates.push_back({static_cast<std::uint32_t>(pieces.size()), 1, 0});
+            pieces.push_back({Piece::Element, element});
+            operand.kind = CondOperand::Template;
+            operand.index = static_cast<std::uint32_t>(templates.size() - 1);
+            return operand;
+        }
+        std::uint32_t tpl = compile_template(text);
+        const Template& compiled = templates[tpl];
+        for (std::uint32_t i = compiled.first; i < compiled.first + compiled.count; ++i) {
+            if (pieces[i].kind != Piece::Literal) {
+                operand.kind = CondOperand::Template;
+                operand.index = tpl;
+                return operand;
+            }
+        }
+        operand.index = add_operand(text);
+        operand.numeric = try_parse_number(text, operand.number);
+        return operand;
+    }
+
+    // Split a condition at its comparison operator. Operators are tokens
+    // delimited by whitespace (so <expr> segments are not mistaken for
+    // them); a compact a==b or a!=b is accepted as well
+    std::uint32_t compile_condition(std::string_view text) {
+        static const std::pair<const char*, Condition::Compare> comparisons[] = {
+            {"==", Condition::Eq}, {"!=", Condition::Ne}, {"<=", Condition::Le},
+            {">=", Condition::Ge}, {"<", Condition::Lt}, {">", Condition::Gt}};
+
+        auto find = [&](bool spaced, size_t& pos, size_t& len, Condition::Compare& op) {
+            for (size_t i = 0; i < text.size(); ++i) {
+                if (text.compare(i, 2, "{{") == 0) {
+                    size_t end = placeholder_end(text, i);
+                    if (end == std::string_view::npos) return false;
+                    i = end + 1;
+                    continue;
+                }
+                if (spaced && i > 0 && !isspace(static_cast<unsigned char>(text[i - 1]))) continue;
+                for (const auto& comparison : comparisons) {
+                    size_t n = std::strlen(comparison.first);
+                    if (!spaced && n == 1) continue;
+                    if (text.compare(i, n, comparison.first) != 0) continue;
+                    if (spaced && i + n < text.size() && !isspace(static_cast<unsigned char>(text[i + n]))) continue;
+                    pos = i;
+                    len = n;
+                    op = comparison.second;
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        Condition cond{Condition::Truth, {}, {}};
+        size_t pos = 0, len = 0;
+        if (find(true, pos, len, cond.op) || find(false, pos, len, cond.op)) {
+            cond.lhs = compile_operand(text.substr(0, pos));
+            cond.rhs = compile_operand(text.substr(pos + len));
+        } else {
+            cond.lhs = compile_operand(text);
+        }
+        conditions.push_back(cond);
+        return static_cast<std::uint32_t>(conditions.size() - 1);
+    }
+
+    // Split text into literal pieces and variable/expression references
+    std::uint32_t compile_template(std::string_view text) {
+        std::vector<Piece> parts;
+        std::uint32_t literal_size = 0;
+        size_t start = 0; // Start of the pending literal
+        auto flush = [&](size_t end) {
+            if (end > start) {
+                parts.push_back({Piece::Literal, add_operand(text.substr(start, end - start))});
+                literal_size += static_cast<std::uint32_t>(end - start);
+            }
+        };
+
+        size_t i = 0;
+        while (i < text.size()) {
+            if (text.compare(i, 2, "{{") == 0) {
+                size_t end = placeholder_end(text, i);
+                if (end == std::string_view::npos) break;
+                flush(i);
+                std::string_view name = trim(text.substr(i + 2, end - i - 2));
+                std::uint32_t element;
+                if (name.find("{{") != std::string_view::npos) {
+                    parts.push_back({Piece::DynamicVariable, compile_template(name)});
+                } else if ((element = add_element(name)) != NO_TARGET) {
+                    parts.push_back({Piece::Element, element});
+                } else {
+                    parts.push_back({Piece::Variable, intern(name)});
+                }
+                i = start = end + 2;
+            }
+            else if (text[i] == '<') {
+                size_t end = text.find('>', i);
+                if (end == std::string_view::npos) break;
+                std::uint32_t expr;
+                try {
+                    expr = compile_expression(text.substr(i + 1, end - i - 1));
+                } catch (const std::runtime_error&) {
+                    i = end + 1; // Not an expression; keep as literal text
+                    continue;
+                }
+                flush(i);
+                parts.push_back({Piece::Expression, expr, add_operand(text.substr(i, end - i + 1))});
+                i = start = end + 1;
+            }
+            else {
+                i++;
+            }
+        }
+        flush(text.size());
+
+        templates.push_back({static_cast<std::uint32_t>(pieces.size()),
+                             static_cast<std::uint32_t>(parts.size()), literal_size});
+        pieces.insert(pieces.end(), parts.begin(), parts.end());
+        return static_cast<std::uint32_t>(templates.size() - 1);
+    }
+
+    std::uint32_t add_number(double value) {
+        numbers.push_back(value);
+        return static_cast<std::uint32_t>(numbers.size() - 1);
+    }
+
+    // Add a slot to the frame of the function being compiled
+    std::uint32_t add_local(std::string_view name) {
+        Function& fn = functions[current_function];
+        std::uint32_t index = fn.locals++;
+        local_names.emplace_back(name);
+        if (!name.empty()) local_scope[std::string(name)] = index;
+        return index | LOCAL_SLOT;
+    }
+
+    // Slot for loop bookkeeping that no script name can reach: a nameless
+    // local inside functions, so recursion keeps separate copies
+    std::uint32_t hidden_slot() {
+        if (current_function != NO_TARGET) return add_local({});
+        return intern("\001hidden " + std::to_string(names.size()));
+    }
+
+    // for name = start to limit [step s], or for name in array
+    void compile_for(std::string_view rest, std::uint32_t line_no, Instruction& ins) {
+        auto fail = [&](const std::string& message) {
+            throw std::runtime_error("Invalid 'for' at line " + std::to_string(line_no + 1) + ": " + message);
+        };
+        ins.op = OpCode::For;
+        ins.a = static_cast<std::uint32_t>(for_loops.size());
+        std::string_view var = next_word(rest);
+        std::string_view keyword = next_word(rest);
+        if (is_identifier(var) && keyword == "in" && is_identifier(rest)) {
+            for_loops.push_back({intern(var), 0, 0, NO_TARGET, hidden_slot(), NO_TARGET, intern(rest)});
+            return;
+        }
+        if (!is_identifier(var) || keyword != "=") fail("expected 'for name = start to limit' or 'for name in array'");
+        std::string parts[3]; // start, limit, step
+        size_t part = 0;
+        while (!rest.empty()) {
+            std::string_view token = next_argument(rest);
+            if (part == 0 && token == "to") part = 1;
+            else if (part == 1 && token == "step") part = 2;
+            else {
+                if (!parts[part].empty()) parts[part] += ' ';
+                parts[part] += token;
+            }
+        }
+        if (part == 0 || parts[0].empty() || parts[1].empty() || (part == 2 && parts[2].empty())) {
+            fail("expected 'for name = start to limit' or 'for name in array'");
+        }
+        std::uint32_t expr[3] = {0, 0, NO_TARGET};
+        try {
+            for (size_t i = 0; i <= part; ++i) expr[i] = compile_expression(parts[i]);
+        } catch (const std::runtime_error& e) {
+            fail(e.what());
+        }
+        std::uint32_t limit_slot = hidden_slot();
+        for_loops.push_back({intern(var), expr[0], expr[1], expr[2], limit_slot, hidden_slot()});
+    }
+
+    // Split off one call argument: a "quoted" string or a word, keeping
+    // {{...}} and <...> segments whole
+    static std::string_view next_argument(std::string_view& s) {
+        s = trim(s);
+        if (s.empty()) return s;
+        size_t end = 0;
+        std::string_view arg;
+        if (s[0] == '"') {
+            end = s.find('"', 1);
+            if (end == std::string_view::npos) end = s.size() - 1;
+            arg = s.substr(1, end - 1);
+            end++;
+        } else {
+            while (end < s.size() && !isspace(static_cast<unsigned char>(s[end]))) {
+                if (s.compare(end, 2, "{{") == 0) {
+                    size_t close = placeholder_end(s, end);
+                    end = close == std::string_view::npos ? s.size() : close + 2;
+                } else if (s[end] == '<' && s.find('>', end) != std::string_view::npos) {
+                    end = s.find('>', end) + 1;
+                } else {
+                    end++;
+                }
+            }
+            arg = s.substr(0, end);
+        }
+        s = trim(s.substr(std::min(end, s.size())));
+        return arg;
+    }
+
+    // Lower one source line; returns false when it produces no instruction
+    bool compile_line(std::string_view line, std::uint32_t line_no, Instruction& ins) {
+        size_t comment_pos = line.find("//");
+        if (comment_pos != std::string_view::npos) {
+            line = line.substr(0, comment_pos);
+        }
+        std::string_view rest = line;
+        std::string_view cmd = next_word(rest);
+        if (cmd.empty()) return false;
+
+        ins = Instruction{OpCode::Exit, line_no};
+        if (cmd == "set") {
+            ins.op = OpCode::Set;
+            ins.a = add_name(next_word(rest));
+            ins.b = compile_template(rest);
+        }
+        else if (cmd == "print") {
+            ins.op = OpCode::Print;
+            ins.a = compile_template(rest);
+        }
+        else if (cmd == "input") {
+            ins.op = OpCode::Input;
+            ins.a = add_name(next_word(rest));
+        }
+        else if (cmd == "call") {
+            // call name [args...] [-> result]
+            CallSite site{add_operand(next_word(rest)), NO_TARGET,
+                          static_cast<std::uint32_t>(call_args.size()), 0};
+            std::vector<std::string_view> args;
+            while (!rest.empty()) args.push_back(next_argument(rest));
+            if (args.size() >= 2 && args[args.size() - 2] == "->") {
+                site.result = add_name(args.back());
+                args.resize(args.size() - 2);
+            }
+            std::vector<std::uint32_t> compiled;
+            for (std::string_view arg : args) compiled.push_back(compile_template(arg));
+            call_args.insert(call_args.end(), compiled.begin(), compiled.end());
+            site.args = static_cast<std::uint32_t>(compiled.size());
+            call_sites.push_back(site);
+            ins.op = OpCode::Call;
+            ins.a = static_cast<std::uint32_t>(call_sites.size() - 1);
+        }
+        else if (cmd == "return") {
+            ins.op = OpCode::Return;
+            ins.a = rest.empty() ? NO_TARGET : compile_template(rest);
+        }
+        else if (cmd == "func") {
+            // func name [params...]
+            if (current_function != NO_TARGET) {
+                throw std::runtime_error("Nested 'func' at line " + std::to_string(line_no + 1));
+            }
+            functions.push_back({add_operand(next_word(rest)), 0,
+                                 static_cast<std::uint32_t>(local_names.size()), 0, 0});
+            current_function = static_cast<std::uint32_t>(functions.size() - 1);
+            local_scope.clear();
+            while (!rest.empty()) {
+                add_local(next_word(rest));
+                functions[current_function].params++;
+            }
+            ins.op = OpCode::Func;
+            ins.a = current_function;
+        }
+        else if (cmd == "local") {
+            // local names... declares frame slots for the rest of the function
+            if (current_function == NO_TARGET) {
+                throw std::runtime_error("'local' outside func at line " + std::to_string(line_no + 1));
+            }
+            while (!rest.empty()) add_local(next_word(rest));
+            return false;
+        }
+        else if (cmd == "main") ins.op = OpCode::Main;
+        else if (cmd == "endfunc") {
+            current_function = NO_TARGET;
+            ins.op = OpCode::EndFunc;
+        }
+        else if (cmd == "loop") ins.op = OpCode::Loop;
+        else if (cmd == "endloop") ins.op = OpCode::EndLoop;
+        else if (cmd == "if") {
+            ins.op = OpCode::If;
+            ins.a = compile_condition(rest);
+        }
+        else if (cmd == "else") ins.op = OpCode::Else;
+        else if (cmd == "endif") ins.op = OpCode::EndIf;
+        else if (cmd == "break") ins.op = OpCode::Break;
+        else if (cmd == "continue") ins.op = OpCode::Continue;
+        else if (cmd == "for") compile_for(rest, line_no, ins);
+        else if (cmd == "endfor") ins.op = OpCode::EndFor;
+        else if (cmd == "while") {
+            ins.op = OpCode::While;
+            ins.a = compile_condition(rest);
+        }
+        else if (cmd == "endwhile") ins.op = OpCode::EndWhile;
+        else if (cmd == "foreach") {
+            // foreach var [in file]: one pass per line until the end of
+            // the script input or of an open file
+            std::string_view var = next_word(rest);
+            std::string_view keyword = next_word(rest);
+            if (var.empty() || !(keyword.empty() || (keyword == "in" && is_identifier(rest)))) {
+                throw std::runtime_error("Invalid 'foreach' at line " + std::to_string(line_no + 1) +
+                                         ": expected 'foreach name [in file]'");
+            }
+            ins.op = OpCode::ForEach;
+            ins.a = add_name(var);
+            ins.b = keyword.empty() ? NO_TARGET : intern(rest);
+        }
+        else if (cmd == "endforeach") ins.op = OpCode::EndForEach;
+        else if (cmd == "eof") {
+            // eof var [file]
+            std::string_view var = next_word(rest);
+            if (var.empty() || !(rest.empty() || is_identifier(rest))) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Eof;
+            ins.a = add_name(var);
+            ins.b = rest.empty() ? NO_TARGET : intern(rest);
+        }
+        else if (cmd == "open") {
+            // open file path [read|write|append]
+            std::string_view var = next_word(rest);
+            std::string_view path = next_argument(rest);
+            std::string_view mode = next_word(rest);
+            if (var.empty() || path.empty()) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Open;
+            ins.a = add_name(var);
+            ins.b = compile_template(path);
+            if (mode.empty() || mode == "read") ins.c = ReadFile;
+            else if (mode == "write") ins.c = WriteFile;
+            else if (mode == "append") ins.c = AppendFile;
+            else return invalid_syntax(line_no, cmd);
+        }
+        else if (cmd == "read") {
+            // read var file
+            std::string_view var = next_word(rest);
+            std::string_view file = next_word(rest);
+            if (var.empty() || !is_identifier(file)) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Read;
+            ins.a = add_name(var);
+            ins.b = intern(file);
+        }
+        else if (cmd == "write") {
+            // write file text, as one line
+            std::string_view file = next_word(rest);
+            if (!is_identifier(file)) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Write;
+            ins.a = intern(file);
+            ins.b = compile_template(rest);
+        }
+        else if (cmd == "close") {
+            std::string_view file = next_word(rest);
+            if (!is_identifier(file)) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Close;
+            ins.a = intern(file);
+        }
+        else if (cmd == "slurp") {
+            // slurp var path reads a whole file
+            std::string_view var = next_word(rest);
+            std::string_view path = next_argument(rest);
+            if (var.empty() || path.empty()) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Slurp;
+            ins.a = add_name(var);
+            ins.b = compile_template(path);
+        }
+        else if (cmd == "split" || cmd == "find") {
+            // split var text [separator], find var text needle
+            std::string_view var = next_word(rest);
+            std::string_view text = next_argument(rest);
+            std::string_view other = next_argument(rest);
+            if (var.empty() || text.empty() || (cmd == "find" && other.empty())) return invalid_syntax(line_no, cmd);
+            ins.op = cmd == "split" ? OpCode::Split : OpCode::Find;
+            ins.a = add_name(var);
+            ins.b = compile_template(text);
+            ins.c = other.empty() ? NO_TARGET : compile_template(other);
+        }
+        else if (cmd == "substr") {
+            // substr var text start [length]; start and length are math
+            // expressions, kept in call_args
+            std::string_view var = next_word(rest);
+            std::string_view text = next_argument(rest);
+            std::string_view start = next_argument(rest);
+            std::string_view length = next_argument(rest);
+            if (var.empty() || text.empty() || start.empty()) return invalid_syntax(line_no, cmd);
+            std::uint32_t bounds[2];
+            try {
+                bounds[0] = compile_expression(start);
+                bounds[1] = length.empty() ? NO_TARGET : compile_expression(length);
+            } catch (const std::runtime_error& e) {
+                warn(line_no, "Math error", e.what());
+                return false;
+            }
+            ins.op = OpCode::Substr;
+            ins.a = add_name(var);
+            ins.b = compile_template(text);
+            ins.c = static_cast<std::uint32_t>(call_args.size());
+            call_args.insert(call_args.end(), bounds, bounds + 2);
+        }
+        else if (cmd == "replace") {
+            // replace var text old new; old and new are kept in call_args
+            std::string_view var = next_word(rest);
+            std::string_view text = next_argument(rest);
+            std::string_view from = next_argument(rest);
+            std::string_view to = next_argument(rest);
+            if (var.empty() || text.empty() || from.empty()) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Replace;
+            ins.a = add_name(var);
+            ins.b = compile_template(text);
+            ins.c = static_cast<std::uint32_t>(call_args.size());
+            call_args.push_back(compile_template(from));
+            call_args.push_back(compile_template(to));
+        }
+        else if (cmd == "upper" || cmd == "lower" || cmd == "trim") {
+            // upper var text; the text is the rest of the line
+            std::string_view var = next_word(rest);
+            if (var.empty()) return invalid_syntax(line_no, cmd);
+            ins.op = cmd == "upper" ? OpCode::Upper : cmd == "lower" ? OpCode::Lower : OpCode::Trim;
+            ins.a = add_name(var);
+            ins.b = compile_template(rest);
+        }
+        else if (cmd == "join") {
+            // join var array [separator]
+            std::string_view var = next_word(rest);
+            std::string_view array = next_word(rest);
+            std::string_view separator = next_argument(rest);
+            if (var.empty() || !is_identifier(array)) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Join;
+            ins.a = add_name(var);
+            ins.b = intern(array);
+            ins.c = separator.empty() ? NO_TARGET : compile_template(separator);
+        }
+        else if (cmd == "exit") ins.op = OpCode::Exit;
+        else if (cmd == "math") {
+            std::string_view var = next_word(rest);
+            if (next_word(rest) != "=") {
+                warn(line_no, "Invalid math syntax");
+                return false;
+            }
+            try {
+                ins.b = compile_expression(rest);
+            } catch (const std::runtime_error& e) {
+                warn(line_no, "Math error", e.what());
+                return false;
+            }
+            ins.op = OpCode::Math;
+            ins.a = add_name(var);
+        }
+        else if (cmd == "random") {
+            // random var min max, or random array min max count to fill an
+            // array; max is the number after min
+            std::string_view var = next_word(rest);
+            double min_val, max_val;
+            if (var.empty() ||
+                !try_parse_number(next_word(rest), min_val) ||
+                !try_parse_number(next_word(rest), max_val)) {
+                return invalid_syntax(line_no, cmd);
+            }
+            if (rest.empty()) {
+                ins.op = OpCode::Random;
+                ins.a = add_name(var);
+            } else {
+                if (!is_identifier(var)) return invalid_syntax(line_no, cmd);
+                try {
+                    ins.c = compile_expression(rest);
+                } catch (const std::runtime_error& e) {
+                    warn(line_no, "Math error", e.what());
+                    return false;
+                }
+                ins.op = OpCode::RandomFill;
+                ins.a = intern(var);
+            }
+            ins.b = add_number(min_val);
+            add_number(max_val);
+        }
+        else if (cmd == "seed") {
+            // seed value restarts the random sequence
+            try {
+                ins.a = compile_expression(rest);
+            } catch (const std::runtime_error& e) {
+                warn(line_no, "Math error", e.what());
+                return false;
+            }
+            ins.op = OpCode::Seed;
+        }
+        else if (cmd == "length") {
+            std::string_view var = next_word(rest);
+            std::string_view source = next_word(rest);
+            if (source.empty()) return false;
+            ins.op = OpCode::Length;
+            ins.a = add_name(var);
+            ins.b = compile_template(source);
+        }
+        else if (cmd == "array") {
+            // array name [items...]
+            std::string_view var = next_word(rest);
+            if (!is_identifier(var)) return invalid_syntax(line_no, cmd);
+            std::vector<std::uint32_t> items;
+            while (!rest.empty()) items.push_back(compile_template(next_argument(rest)));
+            ins.op = OpCode::Array;
+            ins.a = intern(var);
+            ins.b = static_cast<std::uint32_t>(call_args.size());
+            ins.c = static_cast<std::uint32_t>(items.size());
+            call_args.insert(call_args.end(), items.begin(), items.end());
+        }
+        else if (cmd == "push") {
+            std::string_view var = next_word(rest);
+            if (!is_identifier(var)) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Push;
+            ins.a = intern(var);
+            ins.b = compile_template(rest);
+        }
+        else if (cmd == "sum" || cmd == "min" || cmd == "max") {
+            std::string_view var = next_word(rest);
+            std::string_view array = next_word(rest);
+            if (var.empty() || !is_identifier(array)) return invalid_syntax(line_no, cmd);
+            ins.op = cmd == "sum" ? OpCode::Sum : cmd == "min" ? OpCode::Min : OpCode::Max;
+            ins.a = add_name(var);
+            ins.b = intern(array);
+        }
+        else if (cmd == "sort") {
+            std::string_view array = next_word(rest);
+            if (!is_identifier(array)) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Sort;
+            ins.a = intern(array);
+        }
+        else if (cmd == "dict") {
+            std::string_view var = next_word(rest);
+            if (!is_identifier(var)) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Dict;
+            ins.a = intern(var);
+        }
+        else if (cmd == "put") {
+            // put dict key value
+            std::string_view var = next_word(rest);
+            std::string_view key = next_argument(rest);
+            if (!is_identifier(var) || key.empty()) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Put;
+            ins.a = intern(var);
+            ins.b = compile_template(key);
+            ins.c = compile_template(rest);
+        }
+        else if (cmd == "get" || cmd == "has") {
+            // get var dict key
+            std::string_view var = next_word(rest);
+            std::string_view dict = next_word(rest);
+            std::string_view key = next_argument(rest);
+            if (var.empty() || !is_identifier(dict) || key.empty()) return invalid_syntax(line_no, cmd);
+            ins.op = cmd == "get" ? OpCode::Get : OpCode::Has;
+            ins.a = add_name(var);
+            ins.b = intern(dict);
+            ins.c = compile_template(key);
+        }
+        else if (cmd == "delete") {
+            std::string_view var = next_word(rest);
+            std::string_view key = next_argument(rest);
+            if (!is_identifier(var) || key.empty()) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Delete;
+            ins.a = intern(var);
+            ins.b = compile_template(key);
+        }
+        else if (cmd == "keys") {
+            std::string_view var = next_word(rest);
+            std::string_view dict = next_word(rest);
+            if (var.empty() || !is_identifier(dict)) return invalid_syntax(line_no, cmd);
+            ins.op = OpCode::Keys;
+            ins.a = add_name(var);
+            ins.b = intern(dict);
+        }
+        else if (cmd == "clear") ins.op = OpCode::Clear;
+        else if (cmd == "time" || cmd == "timestamp") {
+            std::string_view var = next_word(rest);
+            if (var.empty()) return false;
+            ins.op = cmd == "time" ? OpCode::Time : OpCode::Timestamp;
+            ins.a = add_name(var);
+        }
+        else if (cmd == "sleep") {
+            double seconds;
+            if (!try_parse_number(next_word(rest), seconds)) return false;
+            ins.op = OpCode::Sleep;
+            ins.a = add_number(seconds);
+        }
+        else {
+            return false; // Unknown commands are ignored
+        }
+        return true;
+    }
+
+    // Pair every block opener with its partner in one pass; the jump
+    // target of each instruction is the address control moves to
+    void resolve_blocks() {
+        std::vector<size_t> open; // Unclosed block openers
+        auto fail = [&](const std::string& message, size_t i) {
+            throw std::runtime_error(message + " at line " + std::to_string(code[i].line + 1));
+        };
+        auto close = [&](size_t i, OpCode a, OpCode b, const char* keyword) {
+            if (open.empty() || (code[open.back()].op != a && code[open.back()].op != b)) {
+                fail(std::string("Unexpected '") + keyword + "'", i);
+            }
+            size_t opener = open.back();
+            open.pop_back();
+            return opener;
+        };
+
+        for (size_t i = 0; i < code.size(); ++i) {
+            std::uint32_t next = static_cast<std::uint32_t>(i + 1);
+            switch (code[i].op) {
+            case OpCode::If:
+            case OpCode::Loop:
+            case OpCode::For:
+            case OpCode::While:
+            case OpCode::ForEach:
+            case OpCode::Func:
+            case OpCode::Main:
+                open.push_back(i);
+                break;
+            case OpCode::Else: {
+                size_t opener = close(i, OpCode::If, OpCode::If, "else");
+                code[opener].target = next; // False branch enters after else
+                open.push_back(i);
+                break;
+            }
+            case OpCode::EndIf:
+                code[close(i, OpCode::If, OpCode::Else, "endif")].target = next;
+                break;
+            case OpCode::EndLoop:
+            case OpCode::EndFor:
+            case OpCode::EndWhile:
+            case OpCode::EndForEach: {
+                // The opener skips past its closer; the closer jumps back
+                // into the body (all but endloop test first) and shares the
+                // opener's operands
+                OpCode kind = code[i].op == OpCode::EndLoop  ? OpCode::Loop
+                            : code[i].op == OpCode::EndFor   ? OpCode::For
+                            : code[i].op == OpCode::EndWhile ? OpCode::While : OpCode::ForEach;
+                size_t opener = close(i, kind, kind, op_name(code[i].op));
+                code[opener].target = next;
+                code[i].target = static_cast<std::uint32_t>(opener + 1);
+                code[i].a = code[opener].a;
+                code[i].b = code[opener].b;
+                break;
+            }
+            case OpCode::EndFunc:
+                code[close(i, OpCode::Func, OpCode::Main, "endfunc")].target = next;
+                break;
+            case OpCode::Break:
+            case OpCode::Continue: {
+                // Innermost loop of the enclosing function
+                auto it = std::find_if(open.rbegin(), open.rend(), [&](size_t j) {
+                    return is_loop(code[j].op) || code[j].op == OpCode::Func;
+                });
+                if (it == open.rend() || !is_loop(code[*it].op)) {
+                    fail(std::string("'") + op_name(code[i].op) + "' outside loop", i);
+                }
+                code[i].target = static_cast<std::uint32_t>(*it);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+        if (!open.empty()) {
+            fail(std::string("Unclosed '") + op_name(code[open.back()].op) + "'", open.back());
+        }
+        // Break leaves past the closer; continue runs the closer, which
+        // steps and tests the loop
+        for (Instruction& ins : code) {
+            if (ins.op == OpCode::Break) ins.target = code[ins.target].target;
+            else if (ins.op == OpCode::Continue) ins.target = code[ins.target].target - 1;
+        }
+    }
+
+    static bool is_loop(OpCode op) {
+        return op == OpCode::Loop || op == OpCode::For || op == OpCode::While || op == OpCode::ForEach;
+    }
+
+    // Record each function's entry point and index it by name
+    void preprocess_functions() {
+        function_locations.clear();
+        for (size_t i = 0; i < code.size(); ++i) {
+            if (code[i].op == OpCode::Func) {
+                functions[code[i].a].entry = static_cast<std::uint32_t>(i + 1);
+                function_locations[operands[functions[code[i].a].name]] = code[i].a;
+            }
+        }
+    }
+
+    // math x = x + k or x - k on a fixed name becomes Increment by k
+    void fuse_increment(Instruction& ins) {
+        if (ins.a & (DYNAMIC_NAME | ELEMENT_REF)) return;
+        const Expression& expr = expressions[ins.b];
+        if (expr.count != 3) return;
+        const MathOp* op = &math_ops[expr.first];
+        double delta;
+        if (op[0].kind == MathOp::Load && op[0].index == ins.a && op[1].kind == MathOp::Const &&
+            (op[2].kind == MathOp::Add || op[2].kind == MathOp::Sub)) {
+            delta = op[2].kind == MathOp::Add ? op[1].value : -op[1].value;
+        } else if (op[0].kind == MathOp::Const && op[1].kind == MathOp::Load && op[1].index == ins.a &&
+                   op[2].kind == MathOp::Add) {
+            delta = op[0].value;
+        } else {
+            return;
+        }
+        ins.op = OpCode::Increment;
+        ins.c = add_number(delta);
+    }
+
+    // Condition of the form x <op> N with a variable x and a number N
+    bool numeric_compare(std::uint32_t index) const {
+        const Condition& cond = conditions[index];
+        return cond.op != Condition::Truth && cond.lhs.kind == CondOperand::Variable &&
+               cond.rhs.kind == CondOperand::Literal && cond.rhs.numeric;
+    }
+
+    // if x <op> N becomes Compare
+    void fuse_compare(Instruction& ins) {
+        if (numeric_compare(ins.a)) ins.op = OpCode::Compare;
+    }
+
+    // print [text]{{x}}[text] becomes PrintSlot(prefix, slot, suffix)
+    void fuse_print(Instruction& ins) {
+        const Template& tpl = templates[ins.a];
+        const Piece* piece = &pieces[tpl.first];
+        const Piece* end = piece + tpl.count;
+        std::uint32_t prefix = NO_TARGET, suffix = NO_TARGET;
+        if (piece != end && piece->kind == Piece::Literal) prefix = (piece++)->index;
+        if (piece == end || piece->kind != Piece::Variable) return;
+        std::uint32_t variable = (piece++)->index;
+        if (piece != end && piece->kind == Piece::Literal) suffix = (piece++)->index;
+        if (piece != end) return;
+        ins = Instruction{OpCode::PrintSlot, ins.line, prefix, variable, suffix};
+    }
+
+    // Rewrite common shapes into superinstructions. Every instruction keeps
+    // its address, so jump targets stay valid; a fused pair leaves its
+    // second half in place for jumps that land on it.
+    void fuse() {
+        for (Instruction& ins : code) {
+            if (ins.op == OpCode::Math) fuse_increment(ins);
+            else if (ins.op == OpCode::If) fuse_compare(ins);
+            else if (ins.op == OpCode::Print) fuse_print(ins);
+            else if (ins.op == OpCode::While || ins.op == OpCode::EndWhile) ins.c = numeric_compare(ins.a);
+        }
+        for (size_t i = 0; i + 1 < code.size(); ++i) {
+            if (code[i].op == OpCode::Increment && code[i + 1].op == OpCode::Compare) {
+                code[i].op = OpCode::IncrementCompare;
+            }
+        }
+    }
+
+    // Index the final names for lookups by string_view
+    void index_names() {
+        name_index.clear();
+        name_index.reserve(names.size());
+        for (size_t i = 0; i < names.size(); ++i) {
+            name_index.emplace(names[i], static_cast<std::uint32_t>(i));
+        }
+    }
+
+    // Lower the source lines into the instruction stream
+    void compile() {
+        const std::vector<std::string_view>& script_lines = source->lines();
+        code.reserve(script_lines.size());
+        for (size_t i = 0; i < script_lines.size(); ++i) {
+            Instruction ins{OpCode::Exit, 0};
+            if (compile_line(script_lines[i], static_cast<std::uint32_t>(i), ins)) {
+                code.push_back(ins);
+            }
+        }
+        resolve_blocks();
+        fuse();
+        code.push_back({OpCode::End, static_cast<std::uint32_t>(script_lines.size())});
+        index_names();
+        preprocess_functions();
+        for (CallSite& site : call_sites) {
+            auto it = function_locations.find(operands[site.name]);
+            if (it == function_locations.end()) continue;
+            const Function& fn = functions[it->second];
+            if (site.args > fn.params) {
+                throw std::runtime_error("Function '" + operands[site.name] + "' takes " +
+                                         std::to_string(fn.params) + " argument(s)");
+            }
+            site.function = static_cast<std::uint32_t>(it->second);
+        }
+    }};
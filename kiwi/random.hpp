@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <utility>
+
+// xoshiro256** generator: 256 bits of state, a few shifts and rotates per
+// 64-bit draw, and no shared global state, so every context owns one and
+// equal seeds replay equal sequences on any platform.
+class KiwiRandom {
+public:
+    explicit KiwiRandom(std::uint64_t value = 0) { seed(value); }
+
+    // Restart the sequence; the state is expanded from value with
+    // splitmix64, as the xoshiro authors recommend
+    void seed(std::uint64_t value) {
+        for (std::uint64_t& word : state) {
+            value += 0x9e3779b97f4a7c15ull;
+            std::uint64_t z = value;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    std::uint64_t next() {
+        std::uint64_t result = rotl(state[1] * 5, 7) * 9;
+        std::uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    // Uniform integer in [0, n) for n > 0, without modulo bias. Lemire's
+    // multiply-shift needs a division only for the rare draws that land in
+    // the biased zone.
+    std::uint64_t below(std::uint64_t n) {
+#ifdef __SIZEOF_INT128__
+        Wide m = static_cast<Wide>(next()) * n;
+        std::uint64_t low = static_cast<std::uint64_t>(m);
+        if (low < n) {
+            std::uint64_t threshold = (0 - n) % n;
+            while (low < threshold) {
+                m = static_cast<Wide>(next()) * n;
+                low = static_cast<std::uint64_t>(m);
+            }
+        }
+        return static_cast<std::uint64_t>(m >> 64);
+#else
+        std::uint64_t threshold = (0 - n) % n;
+        std::uint64_t r;
+        do r = next(); while (r < threshold);
+        return r % n;
+#endif
+    }
+
+    // Uniform double in [0, 1) with all 53 mantissa bits random
+    double uniform() { return static_cast<double>(next() >> 11) * 0x1.0p-53; }
+
+    // Uniform number between min and max: an integer in [min, max] when
+    // both are integers, otherwise a real in [min, max)
+    double between(double min, double max) {
+        if (max < min) std::swap(min, max);
+        double span = max - min;
+        if (span < 0x1.0p53 && std::floor(min) == min && std::floor(max) == max) {
+            return min + static_cast<double>(below(static_cast<std::uint64_t>(span) + 1));
+        }
+        return min + uniform() * span;
+    }
+
+private:
+#ifdef __SIZEOF_INT128__
+    // __extension__ keeps -Wpedantic quiet about the non-standard type
+    __extension__ typedef unsigned __int128 Wide;
+#endif
+
+    std::uint64_t state[4];
+
+    static std::uint64_t rotl(std::uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
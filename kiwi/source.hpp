@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "platform.hpp"
+
+#if KIWI_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only mapping of a whole file. Without POSIX the file is read into
+// memory instead.
+class KiwiMapping {
+public:
+    KiwiMapping() = default;
+
+#if KIWI_POSIX
+    // Map path; throws std::runtime_error when it cannot be read
+    explicit KiwiMapping(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) fail(path);
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            int error = errno;
+            ::close(fd);
+            fail(path, error);
+        }
+        if (info.st_size > 0) {
+            size_t length = static_cast<size_t>(info.st_size);
+            void* map = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                int error = errno;
+                ::close(fd);
+                fail(path, error);
+            }
+            ::madvise(map, length, MADV_SEQUENTIAL);
+            address = map;
+            size = length;
+        }
+        ::close(fd); // The mapping stays valid without the descriptor
+    }
+
+    KiwiMapping(KiwiMapping&& other) noexcept : address(other.address), size(other.size) {
+        other.address = nullptr;
+        other.size = 0;
+    }
+
+    KiwiMapping& operator=(KiwiMapping&& other) noexcept {
+        std::swap(address, other.address);
+        std::swap(size, other.size);
+        return *this;
+    }
+
+    ~KiwiMapping() {
+        if (address) ::munmap(address, size);
+    }
+
+    std::string_view bytes() const { return {static_cast<const char*>(address), size}; }
+#else
+    // Read path; throws std::runtime_error when it cannot be read
+    explicit KiwiMapping(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) fail(path);
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        if (in.bad()) fail(path);
+    }
+
+    KiwiMapping(KiwiMapping&&) noexcept = default;
+    KiwiMapping& operator=(KiwiMapping&&) noexcept = default;
+
+    std::string_view bytes() const { return contents; }
+#endif
+
+    KiwiMapping(const KiwiMapping&) = delete;
+    KiwiMapping& operator=(const KiwiMapping&) = delete;
+
+private:
+#if KIWI_POSIX
+    void* address = nullptr;
+    size_t size = 0;
+#else
+    std::string contents;
+#endif
+
+    [[noreturn]] static void fail(const std::string& path, int error = errno) {
+        throw std::runtime_error("Cannot read '" + path + "': " + std::strerror(error));
+    }
+};
+
+// Script text held in memory, either a read-only mapping of a file or an
+// owned string, split into lines that point straight into it
+class KiwiSource {
+public:
+    // Own a copy of text
+    explicit KiwiSource(std::string text) : owned(std::move(text)) {
+        data = owned;
+        split();
+    }
+
+    // Join lines with '\n' into one owned buffer
+    static std::shared_ptr<const KiwiSource> from_lines(const std::vector<std::string>& lines) {
+        size_t size = 0;
+        for (const std::string& line : lines) size += line.size() + 1;
+        std::string text;
+        text.reserve(size);
+        for (const std::string& line : lines) {
+            text += line;
+            text += '\n';
+        }
+        return std::make_shared<const KiwiSource>(std::move(text));
+    }
+
+    // Map a file read-only; throws std::runtime_error when it cannot be read
+    static std::shared_ptr<const KiwiSource> from_file(const std::string& path) {
+        std::shared_ptr<KiwiSource> source(new KiwiSource());
+        source->mapping = KiwiMapping(path);
+        source->data = source->mapping.bytes();
+        source->split();
+        return source;
+    }
+
+    KiwiSource(const KiwiSource&) = delete;
+    KiwiSource& operator=(const KiwiSource&) = delete;
+
+    std::string_view text() const { return data; }
+
+    // Lines without their '\n', as std::getline would read them
+    const std::vector<std::string_view>& lines() const { return line_views; }
+
+private:
+    std::string owned;                        // Text when not mapped
+    KiwiMapping mapping;                      // Mapped file, if any
+    std::string_view data;                    // Whole text
+    std::vector<std::string_view> line_views; // Lines into data
+
+    KiwiSource() = default;
+
+    // Index the lines in two memchr passes: count, then record
+    void split() {
+        const char* p = data.data();
+        const char* end = p + data.size();
+        size_t count = 0;
+        for (const char* q = p; q < end; ++count) {
+            const char* nl = static_cast<const char*>(std::memchr(q, '\n', end - q));
+            q = nl ? nl + 1 : end;
+        }
+        line_views.reserve(count);
+        while (p < end) {
+            const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            const char* stop = nl ? nl : end;
+            line_views.emplace_back(p, stop - p);
+            p = nl ? nl + 1 : end;
+        }
+    }
+};
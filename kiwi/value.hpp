@@ -0,0 +1,332 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class KiwiDict;
+
+// Variable value: unset, a number, a string, an array or a dict. Strings
+// of up to INLINE_CAPACITY bytes live inside the value. Longer ones live
+// in a reference-counted heap buffer that copies of the value share, so
+// copying a long string is O(1); a buffer is written only while one value
+// holds it, and reused when that value is reassigned. The count is not
+// atomic: a value and its copies belong to one thread, as a context does.
+// Arrays (owned contiguous vectors of values) and dicts are copied with
+// the value.
+class KiwiValue {
+public:
+    enum Kind : std::uint8_t { Unset, Number, String, Array, Dict };
+
+    using Elements = std::vector<KiwiValue>;
+
+    static constexpr size_t INLINE_CAPACITY = 24;
+
+    KiwiValue() noexcept : number_(0) {}
+    KiwiValue(double value) noexcept : number_(value), kind_(Number) {}
+    KiwiValue(std::string_view text) : number_(0) { set_text(text); }
+
+    KiwiValue(const KiwiValue& other) : number_(0) { *this = other; }
+
+    KiwiValue(KiwiValue&& other) noexcept : number_(0) { steal(other); }
+
+    KiwiValue& operator=(const KiwiValue& other) {
+        if (this == &other) return *this;
+        if (other.kind_ == String && other.heap_) {
+            if (kind_ == String && heap_ && shared_ == other.shared_) return *this;
+            Shared* shared = other.shared_; // other may live inside this array or dict
+            shared->refs++;
+            release();
+            shared_ = shared;
+            kind_ = String;
+            heap_ = true;
+        } else if (other.kind_ == String) {
+            set_text(other.text());
+        } else if (other.kind_ == Array) {
+            Elements* copy = new Elements(*other.array_); // other may live inside this array
+            release();
+            array_ = copy;
+            kind_ = Array;
+            heap_ = true;
+        } else if (other.kind_ == Dict) {
+            copy_dict(other);
+        } else {
+            double number = other.number_;
+            Kind kind = other.kind_;
+            release();
+            number_ = number;
+            kind_ = kind;
+        }
+        return *this;
+    }
+
+    KiwiValue& operator=(KiwiValue&& other) noexcept {
+        if (this != &other) {
+            release();
+            steal(other);
+        }
+        return *this;
+    }
+
+    KiwiValue& operator=(double value) noexcept {
+        set_number(value);
+        return *this;
+    }
+
+    KiwiValue& operator=(std::string_view text) {
+        set_text(text);
+        return *this;
+    }
+
+    ~KiwiValue() { release(); }
+
+    Kind kind() const { return kind_; }
+    bool is_unset() const { return kind_ == Unset; }
+    bool is_number() const { return kind_ == Number; }
+    bool is_string() const { return kind_ == String; }
+    bool is_array() const { return kind_ == Array; }
+    bool is_dict() const { return kind_ == Dict; }
+
+    // Number; only meaningful when is_number()
+    double number() const { return number_; }
+
+    // String contents; empty unless is_string()
+    std::string_view text() const {
+        if (kind_ != String) return {};
+        return heap_ ? std::string_view(shared_->data(), shared_->size) : std::string_view(inline_, inline_size_);
+    }
+
+    void set_number(double value) noexcept {
+        release();
+        number_ = value;
+        kind_ = Number;
+    }
+
+    // Store a copy of text, in place when this value alone holds a buffer
+    // big enough for it
+    void set_text(std::string_view text) {
+        if (text.data() == nullptr) text = std::string_view("", 0); // memcpy wants a pointer even for no bytes
+        if (kind_ == String && heap_ && shared_->refs == 1 && text.size() <= shared_->capacity) {
+            std::memmove(shared_->data(), text.data(), text.size());
+            shared_->size = text.size();
+            return;
+        }
+        if (text.size() <= INLINE_CAPACITY) {
+            char copy[INLINE_CAPACITY];
+            std::memcpy(copy, text.data(), text.size()); // text may point into this value
+            release();
+            std::memcpy(inline_, copy, text.size());
+            inline_size_ = static_cast<std::uint8_t>(text.size());
+        } else {
+            Shared* shared = Shared::allocate(text.size());
+            std::memcpy(shared->data(), text.data(), text.size());
+            release();
+            shared_ = shared;
+            heap_ = true;
+        }
+        kind_ = String;
+    }
+
+    // Elements; only valid when is_array()
+    Elements& elements() { return *array_; }
+    const Elements& elements() const { return *array_; }
+
+    // Turn into an empty array and return its elements
+    Elements& make_array() {
+        Elements* empty = new Elements();
+        release();
+        array_ = empty;
+        kind_ = Array;
+        heap_ = true;
+        return *array_;
+    }
+
+    // Table; only valid when is_dict()
+    KiwiDict& dict() { return *dict_; }
+    const KiwiDict& dict() const { return *dict_; }
+
+    // Turn into an empty dict and return it
+    KiwiDict& make_dict();
+
+    void clear() noexcept {
+        release();
+        kind_ = Unset;
+    }
+
+private:
+    // Header of a long string's buffer; the bytes follow it
+    struct Shared {
+        size_t refs;     // Values holding the buffer
+        size_t size;
+        size_t capacity;
+
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+
+        static Shared* allocate(size_t capacity) {
+            Shared* shared = static_cast<Shared*>(::operator new(sizeof(Shared) + capacity));
+            shared->refs = 1;
+            shared->size = capacity;
+            shared->capacity = capacity;
+            return shared;
+        }
+    };
+
+    union {
+        double number_;
+        Shared* shared_;
+        Elements* array_;
+        KiwiDict* dict_;
+        char inline_[INLINE_CAPACITY];
+    };
+    Kind kind_ = Unset;
+    bool heap_ = false;            // String is in shared_, or the array or dict is owned
+    std::uint8_t inline_size_ = 0; // Length of an inline string
+
+    // Free the heap buffer, array or dict, if any; the kind is left to
+    // the caller
+    void release() noexcept;
+
+    void copy_dict(const KiwiValue& other);
+
+    void steal(KiwiValue& other) noexcept {
+        std::memcpy(inline_, other.inline_, INLINE_CAPACITY); // Whichever member is active
+        kind_ = other.kind_;
+        heap_ = other.heap_;
+        inline_size_ = other.inline_size_;
+        other.heap_ = false;
+        other.kind_ = Unset;
+    }
+};
+
+// String-keyed table of values with open addressing. Entries are kept
+// densely in insertion order, which is also the iteration order; the
+// probe table holds only entry positions, so a lookup walks a few
+// adjacent 4-byte slots and compares stored hashes before any key.
+// Removed entries stay as tombstones until the table is next rebuilt.
+class KiwiDict {
+public:
+    struct Entry {
+        std::string key;
+        KiwiValue value;
+        size_t hash;
+        bool removed = false;
+    };
+
+    // Live entries
+    size_t size() const { return live; }
+
+    // Entries in insertion order, including removed ones to skip
+    const std::vector<Entry>& entries() const { return entries_; }
+
+    // Value stored under key, or nullptr
+    KiwiValue* find(std::string_view key) {
+        if (index_.empty()) return nullptr;
+        size_t hash = hash_key(key);
+        for (size_t i = hash & (index_.size() - 1);; i = (i + 1) & (index_.size() - 1)) {
+            std::uint32_t slot = index_[i];
+            if (slot == EMPTY) return nullptr;
+            if (slot != REMOVED && entries_[slot].hash == hash && entries_[slot].key == key) {
+                return &entries_[slot].value;
+            }
+        }
+    }
+
+    const KiwiValue* find(std::string_view key) const { return const_cast<KiwiDict*>(this)->find(key); }
+
+    // Value stored under key, inserted unset when missing
+    KiwiValue& operator[](std::string_view key) {
+        if (KiwiValue* value = find(key)) return *value;
+        if ((entries_.size() + 1) * 4 > index_.size() * 3) rebuild();
+        size_t hash = hash_key(key);
+        place(static_cast<std::uint32_t>(entries_.size()), hash);
+        entries_.push_back({std::string(key), KiwiValue(), hash});
+        live++;
+        return entries_.back().value;
+    }
+
+    // Remove key; false when it was not present
+    bool erase(std::string_view key) {
+        if (index_.empty()) return false;
+        size_t hash = hash_key(key);
+        for (size_t i = hash & (index_.size() - 1);; i = (i + 1) & (index_.size() - 1)) {
+            std::uint32_t slot = index_[i];
+            if (slot == EMPTY) return false;
+            if (slot != REMOVED && entries_[slot].hash == hash && entries_[slot].key == key) {
+                index_[i] = REMOVED;
+                Entry& entry = entries_[slot];
+                entry.removed = true;
+                entry.key.clear();
+                entry.value.clear();
+                live--;
+                return true;
+            }
+        }
+    }
+
+private:
+    static constexpr std::uint32_t EMPTY = UINT32_MAX;
+    static constexpr std::uint32_t REMOVED = UINT32_MAX - 1;
+
+    std::vector<Entry> entries_;       // Dense, in insertion order
+    std::vector<std::uint32_t> index_; // Power-of-two probe table of entry positions
+    size_t live = 0;
+
+    static size_t hash_key(std::string_view key) { return std::hash<std::string_view>()(key); }
+
+    // Store entry position in the first free slot of its probe sequence
+    void place(std::uint32_t position, size_t hash) {
+        size_t i = hash & (index_.size() - 1);
+        while (index_[i] != EMPTY) i = (i + 1) & (index_.size() - 1);
+        index_[i] = position;
+    }
+
+    // Drop tombstones and size the probe table to stay under 3/8 full
+    void rebuild() {
+        if (live != entries_.size()) {
+            entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                          [](const Entry& entry) { return entry.removed; }),
+                           entries_.end());
+        }
+        size_t capacity = 8;
+        while ((live + 1) * 8 > capacity * 3) capacity *= 2;
+        index_.assign(capacity, EMPTY);
+        for (size_t i = 0; i < entries_.size(); ++i) place(static_cast<std::uint32_t>(i), entries_[i].hash);
+    }
+};
+
+inline void KiwiValue::release() noexcept {
+    if (heap_) {
+        if (kind_ == Array) {
+            delete array_;
+            kind_ = Unset;
+        } else if (kind_ == Dict) {
+            delete dict_;
+            kind_ = Unset;
+        } else if (--shared_->refs == 0) {
+            ::operator delete(shared_);
+        }
+        heap_ = false;
+    }
+}
+
+inline void KiwiValue::copy_dict(const KiwiValue& other) {
+    KiwiDict* copy = new KiwiDict(*other.dict_); // other may live inside this dict
+    release();
+    dict_ = copy;
+    kind_ = Dict;
+    heap_ = true;
+}
+
+inline KiwiDict& KiwiValue::make_dict() {
+    KiwiDict* empty = new KiwiDict();
+    release();
+    dict_ = empty;
+    kind_ = Dict;
+    heap_ = true;
+    return *dict_;
+}
@@ -1,18 +1,43 @@
 #include "kiwi/interpreter.hpp"
 #include <fstream>
+#include <cstdlib>
+#include <string>
 
 int main() {
     KiwiInterpreter interpreter;
-    std::ifstream file("script.kiwi");
-    std::vector<std::string> lines;
-    std::string line;
-    
-    while (std::getline(file, line)) {
-        lines.push_back(line);
+
+#if KIWI_POSIX
+    // Nothing else reads stdin here, so the script may take it in large chunks
+    interpreter.set_input(std::make_shared<KiwiFdInput>());
+#endif
+
+    // KIWI_PROFILE=<file> writes a profile at exit: folded stacks for
+    // flamegraph.pl when the name ends in ".folded", a report otherwise
+    const char* profile_path = std::getenv("KIWI_PROFILE");
+    interpreter.enable_profiling(profile_path != nullptr);
+
+    // The compiled script is cached in script.kiwic unless KIWI_NO_CACHE is set
+    try {
+        if (std::getenv("KIWI_NO_CACHE")) {
+            interpreter.load_file("script.kiwi");
+        } else {
+            interpreter.load_file("script.kiwi", "script.kiwic");
+        }
+        interpreter.run();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    if (profile_path) {
+        std::string path = profile_path;
+        std::ofstream out(path);
+        if (path.size() > 7 && path.compare(path.size() - 7, 7, ".folded") == 0) {
+            interpreter.write_folded_stacks(out);
+        } else {
+            interpreter.write_profile_report(out);
+        }
     }
-    
-    interpreter.load_script(lines);
-    interpreter.run();
     
     return 0;
 }
@@ -0,0 +1,245 @@
+// kiwi-tests: regression checks for scripts and compiled programs
+//
+// Build:  g++ -std=c++17 tests/kiwi_tests.cpp -o kiwi-tests
+// Usage:  kiwi-tests [filter]
+
+#include "../kiwi/interpreter.hpp"
+
+#include <cstdio>
+#include <sstream>
+
+struct Test {
+    const char* name;
+    void (*run)();
+};
+
+static int failures = 0;
+
+#define CHECK_EQ(actual, expected)                                                     \
+    do {                                                                               \
+        const std::string actual_ = (actual), expected_ = (expected);                  \
+        if (actual_ != expected_) {                                                    \
+            failures++;                                                                \
+            std::printf("%s:%d: %s\n  expected: \"%s\"\n  actual:   \"%s\"\n",         \
+                        __FILE__, __LINE__, #actual, expected_.c_str(), actual_.c_str()); \
+        }                                                                              \
+    } while (0)
+
+static std::vector<std::string> split_lines(const std::string& text) {
+    std::vector<std::string> lines;
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) lines.push_back(line);
+    return lines;
+}
+
+// What a script printed to its output and error sinks
+struct Transcript {
+    std::string output;
+    std::string errors;
+};
+
+static Transcript run_script(const std::string& text, std::vector<std::string> input = {}) {
+    auto output = std::make_shared<KiwiStringOutput>();
+    auto errors = std::make_shared<KiwiStringOutput>();
+    KiwiInterpreter interpreter;
+    interpreter.set_output(output);
+    interpreter.set_error_output(errors);
+    interpreter.set_input(std::make_shared<KiwiLinesInput>(std::move(input)));
+    interpreter.load_script(split_lines(text));
+    interpreter.run();
+    return {output->str(), errors->str()};
+}
+
+// set stores text as written unless it prints back as the same number
+static void set_keeps_spelling() {
+    Transcript t = run_script(
+        "set zip 02134\n"
+        "set inf Infinity\n"
+        "set price 1.50\n"
+        "set count 42\n"
+        "math next = zip + 1\n"
+        "set double <zip * 2>\n"
+        "set broken <missing + 1>\n"
+        "print {{zip}} {{inf}} {{price}} {{count}} {{next}} {{double}} {{broken}}\n"
+        "if zip == 2134\n"
+        "    print numeric\n"
+        "endif\n");
+    CHECK_EQ(t.output, "02134 Infinity 1.50 42 2135 4268 <missing + 1>\nnumeric\n");
+    CHECK_EQ(t.errors, "");
+}
+
+// Compiled images hold no stray heap bytes: two compilations of one script
+// serialize to the same image, and an image saves back unchanged
+static void cache_images_are_reproducible() {
+    std::vector<std::string> script = split_lines(
+        "set name kiwi\n"
+        "array list 3 1 2\n"
+        "for i = 1 to 3\n"
+        "    math total = i * 2 + list[0]\n"
+        "    if {{total}} >= 7\n"
+        "        print {{name}} {{i}}: <total ^ 2> {{list[1]}}\n"
+        "    endif\n"
+        "endfor\n");
+    auto source = KiwiSource::from_lines(script);
+    std::string first = KiwiBytecode::serialize(KiwiProgram(source));
+    // Leave patterned garbage where the next compilation allocates
+    for (size_t size = 16; size <= 4096; size *= 2) {
+        std::vector<std::string> junk(64, std::string(size, '\xAA'));
+    }
+    std::string second = KiwiBytecode::serialize(KiwiProgram(source));
+    CHECK_EQ(first == second ? "same" : "different", "same");
+
+    auto loaded = KiwiBytecode::deserialize(second, source);
+    CHECK_EQ(!loaded ? "rejected" : KiwiBytecode::serialize(*loaded) == second ? "same" : "different", "same");
+
+    if (loaded) {
+        auto output = std::make_shared<KiwiStringOutput>();
+        KiwiContext context(loaded);
+        context.set_output(output);
+        context.run();
+        CHECK_EQ(output->str(), "kiwi 2: 49 1\nkiwi 3: 81 1\n");
+    }
+}
+
+// Malformed array commands are reported and skipped
+static void array_syntax_errors() {
+    Transcript t = run_script(
+        "array 1st a b\n"
+        "push\n"
+        "sum total\n"
+        "max\n"
+        "sort\n"
+        "array list 3 1 2\n"
+        "sort list\n"
+        "print {{list}}\n");
+    CHECK_EQ(t.output, "[1, 2, 3]\n");
+    CHECK_EQ(t.errors,
+             "Invalid 'array' syntax at line 1\n"
+             "Invalid 'push' syntax at line 2\n"
+             "Invalid 'sum' syntax at line 3\n"
+             "Invalid 'max' syntax at line 4\n"
+             "Invalid 'sort' syntax at line 5\n");
+}
+
+// Malformed dict commands are reported and skipped
+static void dict_syntax_errors() {
+    Transcript t = run_script(
+        "dict\n"
+        "put ages\n"
+        "get age ages\n"
+        "has\n"
+        "delete ages\n"
+        "keys names\n"
+        "dict ages\n"
+        "put ages kiwi 7\n"
+        "get age ages kiwi\n"
+        "print {{age}}\n");
+    CHECK_EQ(t.output, "7\n");
+    CHECK_EQ(t.errors,
+             "Invalid 'dict' syntax at line 1\n"
+             "Invalid 'put' syntax at line 2\n"
+             "Invalid 'get' syntax at line 3\n"
+             "Invalid 'has' syntax at line 4\n"
+             "Invalid 'delete' syntax at line 5\n"
+             "Invalid 'keys' syntax at line 6\n");
+}
+
+// A malformed eof is reported and skipped; input lines still stream
+static void eof_syntax_errors() {
+    Transcript t = run_script(
+        "eof\n"
+        "eof done two words\n"
+        "foreach line\n"
+        "    print got {{line}}\n"
+        "endforeach\n"
+        "eof done\n"
+        "print {{done}}\n",
+        {"a", "b"});
+    CHECK_EQ(t.output, "got a\ngot b\n1\n");
+    CHECK_EQ(t.errors,
+             "Invalid 'eof' syntax at line 1\n"
+             "Invalid 'eof' syntax at line 2\n");
+}
+
+// Malformed file commands are reported and skipped
+static void file_syntax_errors() {
+    Transcript t = run_script(
+        "open log\n"
+        "open log out.txt sideways\n"
+        "read line\n"
+        "write\n"
+        "close\n"
+        "slurp text\n"
+        "print done\n");
+    CHECK_EQ(t.output, "done\n");
+    CHECK_EQ(t.errors,
+             "Invalid 'open' syntax at line 1\n"
+             "Invalid 'open' syntax at line 2\n"
+             "Invalid 'read' syntax at line 3\n"
+             "Invalid 'write' syntax at line 4\n"
+             "Invalid 'close' syntax at line 5\n"
+             "Invalid 'slurp' syntax at line 6\n");
+}
+
+// Malformed string commands are reported and skipped
+static void string_syntax_errors() {
+    Transcript t = run_script(
+        "split parts\n"
+        "find at kiwi\n"
+        "substr part kiwi\n"
+        "replace out kiwi\n"
+        "upper\n"
+        "join text\n"
+        "split parts a,b ,\n"
+        "join text parts +\n"
+        "print {{text}}\n");
+    CHECK_EQ(t.output, "a+b\n");
+    CHECK_EQ(t.errors,
+             "Invalid 'split' syntax at line 1\n"
+             "Invalid 'find' syntax at line 2\n"
+             "Invalid 'substr' syntax at line 3\n"
+             "Invalid 'replace' syntax at line 4\n"
+             "Invalid 'upper' syntax at line 5\n"
+             "Invalid 'join' syntax at line 6\n");
+}
+
+// Malformed random draws are reported and skipped
+static void random_syntax_errors() {
+    Transcript t = run_script(
+        "random roll one six\n"
+        "random 2nd 1 6 10\n"
+        "seed 7\n"
+        "random rolls 1 6 4\n"
+        "length count {{rolls}}\n"
+        "print {{count}}\n");
+    CHECK_EQ(t.output, "4\n");
+    CHECK_EQ(t.errors,
+             "Invalid 'random' syntax at line 1\n"
+             "Invalid 'random' syntax at line 2\n");
+}
+
+int main(int argc, char** argv) {
+    std::string filter = argc > 1 ? argv[1] : "";
+    const Test tests[] = {
+        {"set-keeps-spelling", set_keeps_spelling},
+        {"cache-reproducible", cache_images_are_reproducible},
+        {"array-syntax", array_syntax_errors},
+        {"dict-syntax", dict_syntax_errors},
+        {"eof-syntax", eof_syntax_errors},
+        {"file-syntax", file_syntax_errors},
+        {"string-syntax", string_syntax_errors},
+        {"random-syntax", random_syntax_errors},
+    };
+
+    int ran = 0;
+    for (const Test& test : tests) {
+        if (!filter.empty() && std::string(test.name).find(filter) == std::string::npos) continue;
+        int before = failures;
+        test.run();
+        std::printf("%-24s %s\n", test.name, failures == before ? "ok" : "FAILED");
+        ran++;
+    }
+    std::printf("\n%d tests, %d failed checks\n", ran, failures);
+    return failures ? 1 : 0;
+}